@@ -27,55 +27,228 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 
 #define MEMAR_MAGIC "LORD"
+#define MEMAR_INDEX_MAGIC "LIDX"
 #define MEMAR_MAGIC_LEN 4
+#define MEMAR_VERSION 4
 #define FILE_NAME_MAX 99
 
+/* FNV-1a parameters */
+#define FNV_OFFSET 0x811C9DC5U
+#define FNV_PRIME  0x01000193U
+#define FNV64_OFFSET 0xCBF29CE484222325ULL
+#define FNV64_PRIME  0x00000100000001B3ULL
+
 /* Align a value up to a nearest multiple */
 #define ALIGN_UP(value, align) (((value) + (align)-1) & ~((align)-1))
 
 /* File alignment */
 #define FILE_ALIGN 8
+#define FILE_ALIGN_SHIFT 3
+
+/* Page alignment for files that may be mapped directly */
+#define PAGE_ALIGN 4096
+#define PAGE_ALIGN_SHIFT 12
+
+/*
+ * Archive flags
+ *
+ * @MEMAR_PAGE_ALIGNED: Every file payload is page aligned
+ * @MEMAR_COMPRESSED: Files were compressed where possible
+ */
+#define MEMAR_PAGE_ALIGNED 0x0001
+#define MEMAR_COMPRESSED   0x0002
+
+/* Payload codecs */
+#define MEMAR_CODEC_NONE 0
+#define MEMAR_CODEC_LZ4  1
+
+/* Uncompressed length of each block of a compressed file */
+#define MEMAR_BLOCK_SIZE 0x4000
+
+/* LZ4 block format parameters */
+#define LZ4_HASH_BITS 12
+#define LZ4_MINMATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_MAX_OFFSET 0xFFFF
+#define LZ4_RUN_MASK 0x0F
+
+/* Worst case length of a compressed block */
+#define LZ4_BOUND(len) ((len) + ((len) / 255) + 16)
 
 /* Default output archive name */
 #define DEFAULT_OUTPUT "initrd.mr"
 
+/*
+ * Page alignment policy
+ *
+ * @ALIGN_NONE: Only align payloads to FILE_ALIGN
+ * @ALIGN_ELF: Page align ELF images
+ * @ALIGN_ALL: Page align every file
+ */
+typedef enum {
+    ALIGN_NONE,
+    ALIGN_ELF,
+    ALIGN_ALL
+} align_policy_t;
+
 static const char *output_file = DEFAULT_OUTPUT;
 static const char *input_dir = NULL;
-static char file_pad[FILE_ALIGN] = {0};
+static align_policy_t align_policy = ALIGN_NONE;
+static int compress = 0;
+static char **align_names = NULL;
+static size_t nalign_names = 0;
+static char file_pad[PAGE_ALIGN] = {0};
+static size_t nthreads = 0;
+
+/* Previous archive, unchanged files are copied out of it */
+static int prev_fd = -1;
+static void *prev_ar = NULL;
+static size_t prev_len = 0;
 
 /*
  * Represents a header that sits on top of each file
  * in the archive
  *
- * @hdr_size: Length of the header
+ * @magic: Header magic (MEMAR_MAGIC)
+ * @version: Layout version (MEMAR_VERSION)
+ * @align_shift: Payload alignment as a power of two
+ * @codec: Codec the payload is stored with
+ * @hdr_size: Length of the header and its padding
+ * @file_size: Length of the file once decompressed
+ * @data_size: Length of the payload as stored
+ * @data_off: Offset of the payload from the archive base
+ * @hash: FNV-1a hash of the file contents
+ * @fname_size: Length of the filename
  * @name: Filename
  *
  * This format is as follows:
  *
+ * < INDEX >
  * < FILE HEADER   >
+ * < PADDING >
  * < FILE CONTENTS >
  * < PADDING >
  * ...
+ *
+ * The payload and its trailing padding both end on a
+ * multiple of the payload alignment, page aligned files
+ * therefore own every page they touch.
+ *
+ * Files with the same contents share a single payload,
+ * only the first of them is followed by it. A header whose
+ * 'data_off' does not point right past its own padding is
+ * directly followed by the next header.
+ *
+ * Compressed payloads start with a table of 32-bit block
+ * offsets relative to the payload, one per MEMAR_BLOCK_SIZE
+ * bytes of the file plus one that marks the end of the last
+ * block. A block that is as long as its decompressed length
+ * is stored as is.
  */
 struct __attribute__((packed)) file_hdr {
     char magic[MEMAR_MAGIC_LEN];
-    size_t hdr_size;
-    size_t file_size;
+    uint8_t version;
+    uint8_t align_shift;
+    uint8_t codec;
+    uint64_t hdr_size;
+    uint64_t file_size;
+    uint64_t data_size;
+    uint64_t data_off;
+    uint64_t hash;
+    uint8_t fname_size;
     char name[FILE_NAME_MAX];
 };
 
+/*
+ * Represents the index block at the head of the archive,
+ * it is followed by 'nbuckets' buckets forming an open
+ * addressed hash table of file names.
+ *
+ * @magic: Index magic (MEMAR_INDEX_MAGIC)
+ * @version: Layout version (MEMAR_VERSION)
+ * @flags: Archive flags
+ * @nbuckets: Number of buckets, a power of two
+ * @length: Length of the index block, the first file
+ *          header follows it.
+ */
+struct __attribute__((packed)) memar_index {
+    char magic[MEMAR_MAGIC_LEN];
+    uint16_t version;
+    uint16_t flags;
+    uint32_t nbuckets;
+    uint64_t length;
+};
+
+/*
+ * Represents a bucket within the index
+ *
+ * @hash: FNV-1a hash of the file name
+ * @name_len: Length of the file name
+ * @offset: Offset of the file header from the archive
+ *          base, zero if the bucket is empty.
+ */
+struct __attribute__((packed)) memar_bucket {
+    uint32_t hash;
+    uint32_t name_len;
+    uint64_t offset;
+};
+
+/*
+ * Represents a file to be written to the archive
+ *
+ * @path: Path of the file on the host
+ * @name: Name of the file within the archive
+ * @size: Length of the file
+ * @align_shift: Payload alignment as a power of two
+ * @codec: Codec the payload is stored with
+ * @zdata: Compressed payload, NULL if stored as is
+ * @stored: Length of the payload as stored
+ * @hash: FNV-1a hash of the file contents
+ * @reuse: Offset of an identical payload within the
+ *         previous archive, zero if there is none.
+ * @error: Set if the file could not be staged
+ * @dup: Earlier file whose payload is shared, NULL if none
+ * @offset: Offset of its header within the archive
+ * @hdr_size: Length of its header and padding
+ * @data: Offset of its payload within the archive
+ */
+struct memar_file {
+    char *path;
+    const char *name;
+    size_t size;
+    uint8_t align_shift;
+    uint8_t codec;
+    void *zdata;
+    size_t stored;
+    uint64_t hash;
+    size_t reuse;
+    int error;
+    struct memar_file *dup;
+    size_t offset;
+    size_t hdr_size;
+    size_t data;
+};
+
+static struct memar_file *files = NULL;
+static size_t nfiles = 0;
+static size_t next_file = 0;
+static pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void
 help(void)
 {
@@ -86,26 +259,52 @@ help(void)
         "[-h]   Display this help menu\n"
         "[-i]   Input directory to generate from\n"
         "[-o]   Output archive file\n"
+        "[-a]   Page align every file\n"
+        "[-e]   Page align ELF images\n"
+        "[-p]   Page align a file by archive name (repeatable)\n"
+        "[-z]   Compress files that are not page aligned\n"
+        "[-j]   Number of threads to stage files with\n"
     );
 }
 
 /*
- * Initializes a file header and returns the length
+ * Hash a file name with FNV-1a
  */
-static size_t
-file_hdr_init(const char *name, size_t file_sz, struct file_hdr *hdr)
+static uint32_t
+name_hash(const char *name, size_t len)
 {
-    size_t name_len;
+    uint32_t hash = FNV_OFFSET;
 
-    if (name == NULL || hdr == NULL) {
-        return 0;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t)name[i];
+        hash *= FNV_PRIME;
     }
 
+    return hash;
+}
+
+/*
+ * Returns the name a path is stored under within
+ * the archive
+ */
+static const char *
+archive_name(const char *path)
+{
     /* Skip the root of the archive name */
-    while (*name != '/' && *name != '\0') {
-        ++name;
+    while (*path != '/' && *path != '\0') {
+        ++path;
     }
-    ++name;
+
+    return (*path == '/') ? path + 1 : path;
+}
+
+/*
+ * Returns the length of an archive name as stored
+ */
+static size_t
+archive_name_len(const char *name)
+{
+    size_t name_len;
 
     /* Truncate name if needed */
     name_len = strlen(name);
@@ -113,65 +312,772 @@ file_hdr_init(const char *name, size_t file_sz, struct file_hdr *hdr)
         name_len = FILE_NAME_MAX - 1;
     }
 
-    memcpy(hdr->name, name, name_len);
+    return name_len;
+}
+
+/*
+ * Returns true if a file starts with the ELF magic
+ */
+static int
+is_elf(const void *data, size_t len)
+{
+    return len >= 4 && memcmp(data, "\177ELF", 4) == 0;
+}
+
+/*
+ * Returns the payload alignment of a file as a power
+ * of two according to the alignment policy
+ */
+static uint8_t
+file_align_shift(const void *data, size_t len, const char *name)
+{
+    for (size_t i = 0; i < nalign_names; ++i) {
+        if (strcmp(align_names[i], name) == 0)
+            return PAGE_ALIGN_SHIFT;
+    }
+
+    switch (align_policy) {
+    case ALIGN_ALL:
+        return PAGE_ALIGN_SHIFT;
+    case ALIGN_ELF:
+        return is_elf(data, len) ? PAGE_ALIGN_SHIFT : FILE_ALIGN_SHIFT;
+    default:
+        return FILE_ALIGN_SHIFT;
+    }
+}
+
+static uint32_t
+lz4_hash(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/*
+ * Write the trailing bytes of a run length
+ */
+static uint8_t *
+lz4_put_length(uint8_t *op, size_t len)
+{
+    while (len >= 0xFF) {
+        *op++ = 0xFF;
+        len -= 0xFF;
+    }
+
+    *op++ = len;
+    return op;
+}
+
+/*
+ * Write a sequence, 'match_len' is zero for the
+ * final one which only has literals.
+ */
+static uint8_t *
+lz4_put_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len,
+    size_t offset, size_t match_len)
+{
+    uint8_t *token = op++;
+
+    *token = ((lit_len >= LZ4_RUN_MASK) ? LZ4_RUN_MASK : lit_len) << 4;
+    if (lit_len >= LZ4_RUN_MASK) {
+        op = lz4_put_length(op, lit_len - LZ4_RUN_MASK);
+    }
+
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0) {
+        return op;
+    }
+
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+
+    match_len -= LZ4_MINMATCH;
+    *token |= (match_len >= LZ4_RUN_MASK) ? LZ4_RUN_MASK : match_len;
+    if (match_len >= LZ4_RUN_MASK) {
+        op = lz4_put_length(op, match_len - LZ4_RUN_MASK);
+    }
+
+    return op;
+}
+
+/*
+ * Compress a single block into the LZ4 block format,
+ * 'dst' must be at least LZ4_BOUND(len) bytes.
+ *
+ * Returns the length of the compressed block
+ */
+static size_t
+lz4_compress(const uint8_t *src, size_t len, uint8_t *dst)
+{
+    uint32_t table[1 << LZ4_HASH_BITS];
+    const uint8_t *ip = src, *anchor = src, *end = src + len;
+    const uint8_t *match, *match_limit, *mf_limit;
+    uint8_t *op = dst;
+    uint32_t hash, ref;
+    size_t match_len;
+
+    memset(table, 0, sizeof(table));
+    mf_limit = (len > LZ4_MFLIMIT) ? end - LZ4_MFLIMIT : src;
+    match_limit = (len > LZ4_LAST_LITERALS) ? end - LZ4_LAST_LITERALS : src;
+
+    /* Greedily take the most recent match */
+    while (ip < mf_limit) {
+        hash = lz4_hash(ip);
+        ref = table[hash];
+        table[hash] = (ip - src) + 1;
+        if (ref == 0) {
+            ++ip;
+            continue;
+        }
+
+        match = src + (ref - 1);
+        if (ip - match > LZ4_MAX_OFFSET ||
+            memcmp(match, ip, LZ4_MINMATCH) != 0) {
+            ++ip;
+            continue;
+        }
+
+        match_len = LZ4_MINMATCH;
+        while (ip + match_len < match_limit &&
+            match[match_len] == ip[match_len]) {
+            ++match_len;
+        }
+
+        op = lz4_put_sequence(op, anchor, ip - anchor, ip - match, match_len);
+        ip += match_len;
+        anchor = ip;
+    }
+
+    op = lz4_put_sequence(op, anchor, end - anchor, 0, 0);
+    return op - dst;
+}
+
+/*
+ * Compress a file in blocks, the file is left as is
+ * if compressing it does not make it any smaller.
+ */
+static int
+compress_file(struct memar_file *fp, const uint8_t *data)
+{
+    uint8_t *out, *zblock;
+    uint32_t *table;
+    size_t nblocks, table_len, off, raw_len, len;
+
+    nblocks = ALIGN_UP(fp->size, MEMAR_BLOCK_SIZE) / MEMAR_BLOCK_SIZE;
+    table_len = (nblocks + 1) * sizeof(*table);
+    if (nblocks == 0) {
+        return 0;
+    }
+
+    zblock = malloc(LZ4_BOUND(MEMAR_BLOCK_SIZE));
+    out = malloc(table_len + (nblocks * LZ4_BOUND(MEMAR_BLOCK_SIZE)));
+    if (zblock == NULL || out == NULL) {
+        perror("malloc");
+        free(zblock);
+        free(out);
+        return -1;
+    }
+
+    table = (uint32_t *)out;
+    off = table_len;
+    for (size_t i = 0; i < nblocks; ++i) {
+        raw_len = fp->size - (i * MEMAR_BLOCK_SIZE);
+        if (raw_len > MEMAR_BLOCK_SIZE) {
+            raw_len = MEMAR_BLOCK_SIZE;
+        }
+
+        /* Blocks that do not shrink are stored as is */
+        len = lz4_compress(data, raw_len, zblock);
+        if (len >= raw_len) {
+            memcpy(out + off, data, raw_len);
+            len = raw_len;
+        } else {
+            memcpy(out + off, zblock, len);
+        }
+
+        table[i] = off;
+        off += len;
+        data += raw_len;
+    }
+
+    table[nblocks] = off;
+    free(zblock);
+
+    if (off >= fp->size) {
+        free(out);
+        return 0;
+    }
+
+    fp->codec = MEMAR_CODEC_LZ4;
+    fp->zdata = out;
+    fp->stored = off;
+    return 0;
+}
+
+/*
+ * Initializes a file header
+ */
+static void
+file_hdr_init(struct memar_file *fp, struct file_hdr *hdr)
+{
+    size_t name_len;
+
+    name_len = archive_name_len(fp->name);
     memcpy(hdr->magic, MEMAR_MAGIC, MEMAR_MAGIC_LEN);
-    hdr->hdr_size = name_len;
-    hdr->file_size = file_sz;
-    hdr->hdr_size += sizeof(struct file_hdr) - FILE_NAME_MAX;
-    return hdr->hdr_size;
+    memcpy(hdr->name, fp->name, name_len);
+    hdr->version = MEMAR_VERSION;
+    hdr->align_shift = fp->align_shift;
+    hdr->codec = fp->codec;
+    hdr->fname_size = name_len;
+    hdr->hdr_size = fp->hdr_size;
+    hdr->file_size = fp->size;
+    hdr->data_size = fp->stored;
+    hdr->data_off = fp->data;
+    hdr->hash = fp->hash;
+}
+
+/*
+ * Add a file to the list of files to be written
+ */
+static int
+add_file(const char *path)
+{
+    struct memar_file *tmp, *fp;
+    struct stat statb;
+
+    if (stat(path, &statb) < 0) {
+        printf("could not stat \"%s\"\n", path);
+        perror("stat");
+        return -1;
+    }
+
+    tmp = realloc(files, (nfiles + 1) * sizeof(*files));
+    if (tmp == NULL) {
+        perror("realloc");
+        return -1;
+    }
+
+    files = tmp;
+    fp = &files[nfiles++];
+    fp->path = strdup(path);
+    fp->name = archive_name(fp->path);
+    fp->size = statb.st_size;
+    fp->align_shift = FILE_ALIGN_SHIFT;
+    fp->codec = MEMAR_CODEC_NONE;
+    fp->zdata = NULL;
+    fp->stored = fp->size;
+    fp->hash = 0;
+    fp->reuse = 0;
+    fp->error = 0;
+    fp->dup = NULL;
+    fp->offset = 0;
+    fp->hdr_size = 0;
+    fp->data = 0;
+    return 0;
+}
+
+/*
+ * Hash the contents of a file with FNV-1a
+ */
+static uint64_t
+content_hash(const uint8_t *data, size_t len)
+{
+    uint64_t hash = FNV64_OFFSET;
+
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= FNV64_PRIME;
+    }
+
+    return hash;
 }
 
+/*
+ * Map the archive left behind by the last build, it is
+ * only used if it was built the same way.
+ */
 static void
-write_file(int out_fd, const char *path)
+prev_open(void)
 {
-    struct file_hdr hdr;
-    void *file;
-    size_t real_size, align_size;
-    size_t hdr_size;
-    uint8_t pad_len;
-    int fd;
+    struct memar_index *index;
+    struct stat statb;
+    uint16_t flags;
 
-    if (path == NULL) {
+    if ((prev_fd = open(output_file, O_RDONLY)) < 0) {
         return;
     }
 
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        printf("could not open \"%s\"\n", path);
-        perror("open");
+    if (fstat(prev_fd, &statb) < 0 || statb.st_size < sizeof(*index)) {
+        close(prev_fd);
+        prev_fd = -1;
+        return;
+    }
+
+    prev_len = statb.st_size;
+    prev_ar = mmap(NULL, prev_len, PROT_READ, MAP_SHARED, prev_fd, 0);
+    if (prev_ar == MAP_FAILED) {
+        prev_ar = NULL;
+        close(prev_fd);
+        prev_fd = -1;
         return;
     }
 
-    /* Obtain the file size */
-    real_size = lseek(fd, 0, SEEK_END);
-    lseek(fd, 0, SEEK_SET);
+    flags = compress ? MEMAR_COMPRESSED : 0;
+    index = prev_ar;
+    if (memcmp(index->magic, MEMAR_INDEX_MAGIC, MEMAR_MAGIC_LEN) != 0 ||
+        index->version != MEMAR_VERSION ||
+        (index->flags & MEMAR_COMPRESSED) != flags ||
+        index->length > prev_len ||
+        index->length < sizeof(*index) +
+        (index->nbuckets * sizeof(struct memar_bucket))) {
+        munmap(prev_ar, prev_len);
+        close(prev_fd);
+        prev_ar = NULL;
+        prev_fd = -1;
+    }
+}
+
+static void
+prev_close(void)
+{
+    if (prev_ar != NULL) {
+        munmap(prev_ar, prev_len);
+        close(prev_fd);
+    }
+
+    prev_ar = NULL;
+    prev_fd = -1;
+}
+
+/*
+ * Lookup a file within the previous archive
+ */
+static struct file_hdr *
+prev_lookup(const char *name, size_t len)
+{
+    struct memar_index *index = prev_ar;
+    struct memar_bucket *buckets, *bp;
+    struct file_hdr *hdr;
+    uint32_t hash, mask, slot;
+
+    if (prev_ar == NULL || index->nbuckets == 0) {
+        return NULL;
+    }
+
+    buckets = (struct memar_bucket *)(index + 1);
+    hash = name_hash(name, len);
+    mask = index->nbuckets - 1;
+    slot = hash & mask;
+
+    for (uint32_t i = 0; i < index->nbuckets; ++i) {
+        bp = &buckets[slot];
+        if (bp->offset == 0) {
+            break;
+        }
+
+        if (bp->hash == hash && bp->name_len == len &&
+            bp->offset + sizeof(*hdr) <= prev_len) {
+            hdr = (struct file_hdr *)((char *)prev_ar + bp->offset);
+            if (hdr->fname_size == len && memcmp(hdr->name, name, len) == 0)
+                return hdr;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    return NULL;
+}
 
-    /* Attempt to map it */
-    file = mmap(NULL, real_size, PROT_READ, MAP_SHARED, fd, 0);
-    if (file == NULL) {
+/*
+ * Hash a file and work out how it is to be stored, the
+ * payload of an unchanged file is reused as is.
+ */
+static int
+stage_file(struct memar_file *fp)
+{
+    struct file_hdr *prev;
+    void *data = file_pad;
+    size_t off;
+    int fd, error = 0;
+
+    if ((fd = open(fp->path, O_RDONLY)) < 0) {
+        printf("could not open \"%s\"\n", fp->path);
+        perror("open");
+        return -1;
+    }
+
+    if (fp->size > 0) {
+        data = mmap(NULL, fp->size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+
+    if (data == MAP_FAILED) {
         perror("mmap");
         close(fd);
-        return;
+        return -1;
     }
 
-    /* Initialize the header */
-    hdr_size = file_hdr_init(path, real_size, &hdr);
+    fp->hash = content_hash(data, fp->size);
+    fp->align_shift = file_align_shift(data, fp->size, fp->name);
+
+    prev = prev_lookup(fp->name, archive_name_len(fp->name));
+    if (prev != NULL && prev->file_size == fp->size &&
+        prev->hash == fp->hash && prev->align_shift == fp->align_shift) {
+        off = prev->data_off;
+        if (off != 0 && off + prev->data_size <= prev_len) {
+            fp->reuse = off;
+            fp->codec = prev->codec;
+            fp->stored = prev->data_size;
+        }
+    }
 
-    /* Compute the length of padding */
-    align_size = ALIGN_UP(real_size, FILE_ALIGN);
-    pad_len = align_size - real_size;
+    /* Page aligned files are meant to be mapped as they are */
+    if (fp->reuse == 0 && compress && fp->align_shift < PAGE_ALIGN_SHIFT) {
+        error = compress_file(fp, data);
+    }
 
-    /* Write the file + padding */
-    write(out_fd, &hdr, hdr_size);
-    write(out_fd, file, real_size);
-    if (pad_len > 0) {
-        write(out_fd, file_pad, pad_len);
+    if (fp->size > 0) {
+        munmap(data, fp->size);
     }
+
     close(fd);
+    return error;
+}
+
+static void *
+stage_worker(void *arg)
+{
+    struct memar_file *fp;
+    size_t i;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&next_lock);
+        i = next_file++;
+        pthread_mutex_unlock(&next_lock);
+        if (i >= nfiles) {
+            break;
+        }
+
+        fp = &files[i];
+        fp->error = stage_file(fp);
+    }
+
+    return NULL;
+}
+
+/*
+ * Stage every file across 'nthreads' threads
+ */
+static int
+stage_files(void)
+{
+    pthread_t *threads;
+    size_t count = nthreads;
+
+    if (count == 0) {
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if (count == 0 || count > nfiles) {
+        count = (nfiles > 0) ? nfiles : 1;
+    }
+
+    if ((threads = calloc(count, sizeof(*threads))) == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    /* The calling thread takes a share as well */
+    next_file = 0;
+    for (size_t i = 1; i < count; ++i) {
+        if (pthread_create(&threads[i], NULL, stage_worker, NULL) != 0) {
+            count = i;
+            break;
+        }
+    }
+
+    stage_worker(NULL);
+    for (size_t i = 1; i < count; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    for (size_t i = 0; i < nfiles; ++i) {
+        if (files[i].error != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns true if two files have the same contents
+ */
+static int
+same_content(struct memar_file *a, struct memar_file *b)
+{
+    void *data_a = MAP_FAILED, *data_b = MAP_FAILED;
+    int fd_a, fd_b, same = 0;
+
+    if (a->size != b->size || a->hash != b->hash) {
+        return 0;
+    }
+
+    fd_a = open(a->path, O_RDONLY);
+    fd_b = open(b->path, O_RDONLY);
+    if (fd_a >= 0 && fd_b >= 0) {
+        data_a = mmap(NULL, a->size, PROT_READ, MAP_SHARED, fd_a, 0);
+        data_b = mmap(NULL, b->size, PROT_READ, MAP_SHARED, fd_b, 0);
+    }
+
+    if (data_a != MAP_FAILED && data_b != MAP_FAILED) {
+        same = memcmp(data_a, data_b, a->size) == 0;
+    }
+
+    if (data_a != MAP_FAILED)
+        munmap(data_a, a->size);
+    if (data_b != MAP_FAILED)
+        munmap(data_b, b->size);
+    if (fd_a >= 0)
+        close(fd_a);
+    if (fd_b >= 0)
+        close(fd_b);
+
+    return same;
+}
+
+/*
+ * Point every file at the payload of the first file with
+ * the same contents, as long as that payload is aligned
+ * at least as strictly.
+ *
+ * Returns the number of files that share a payload
+ */
+static size_t
+dedup_files(void)
+{
+    struct memar_file **table, *fp, *cand;
+    size_t nslots = 1, slot, ndup = 0;
+
+    while (nslots < nfiles * 2) {
+        nslots <<= 1;
+    }
+
+    if ((table = calloc(nslots, sizeof(*table))) == NULL) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < nfiles; ++i) {
+        fp = &files[i];
+        if (fp->size == 0) {
+            continue;
+        }
+
+        slot = fp->hash & (nslots - 1);
+        while ((cand = table[slot]) != NULL) {
+            if (cand->align_shift >= fp->align_shift &&
+                same_content(cand, fp)) {
+                break;
+            }
+
+            slot = (slot + 1) & (nslots - 1);
+        }
+
+        if (cand == NULL) {
+            table[slot] = fp;
+            continue;
+        }
+
+        /* Take on the layout of the payload being shared */
+        free(fp->zdata);
+        fp->dup = cand;
+        fp->zdata = NULL;
+        fp->reuse = 0;
+        fp->codec = cand->codec;
+        fp->stored = cand->stored;
+        fp->align_shift = cand->align_shift;
+        ++ndup;
+    }
+
+    free(table);
+    return ndup;
+}
+
+static int
+file_cmp(const void *a, const void *b)
+{
+    const struct memar_file *fa = a, *fb = b;
+
+    return strcmp(fa->name, fb->name);
+}
+
+/*
+ * Write a run of zero bytes
+ */
+static void
+write_pad(int out_fd, size_t len)
+{
+    size_t chunk;
+
+    while (len > 0) {
+        chunk = (len > sizeof(file_pad)) ? sizeof(file_pad) : len;
+        write(out_fd, file_pad, chunk);
+        len -= chunk;
+    }
+}
+
+/*
+ * Lay out the index and every file within the archive
+ * and write the index.
+ */
+static int
+write_index(int out_fd)
+{
+    struct memar_index index;
+    struct memar_bucket *buckets;
+    struct memar_file *fp;
+    size_t nbuckets = 1, off, name_len, align;
+    uint32_t hash, slot;
+
+    /* Keep the table at most half full */
+    while (nbuckets < nfiles * 2) {
+        nbuckets <<= 1;
+    }
+
+    buckets = calloc(nbuckets, sizeof(*buckets));
+    if (buckets == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    memcpy(index.magic, MEMAR_INDEX_MAGIC, MEMAR_MAGIC_LEN);
+    index.version = MEMAR_VERSION;
+    index.flags = (align_policy == ALIGN_ALL) ? MEMAR_PAGE_ALIGNED : 0;
+    index.flags |= compress ? MEMAR_COMPRESSED : 0;
+    index.nbuckets = nbuckets;
+    index.length = sizeof(index) + (nbuckets * sizeof(*buckets));
+    index.length = ALIGN_UP(index.length, FILE_ALIGN);
+
+    off = index.length;
+    for (size_t i = 0; i < nfiles; ++i) {
+        fp = &files[i];
+        align = (size_t)1 << fp->align_shift;
+        name_len = archive_name_len(fp->name);
+
+        /* Headers are padded out so that the payload is aligned */
+        fp->offset = off;
+        off += sizeof(struct file_hdr) - FILE_NAME_MAX + name_len;
+        if (fp->dup != NULL) {
+            off = ALIGN_UP(off, FILE_ALIGN);
+            fp->hdr_size = off - fp->offset;
+            fp->data = fp->dup->data;
+        } else {
+            fp->data = ALIGN_UP(off, align);
+            fp->hdr_size = fp->data - fp->offset;
+            off = fp->data + ALIGN_UP(fp->stored, align);
+        }
+
+        hash = name_hash(fp->name, name_len);
+        slot = hash & (nbuckets - 1);
+        while (buckets[slot].offset != 0) {
+            slot = (slot + 1) & (nbuckets - 1);
+        }
+
+        buckets[slot].hash = hash;
+        buckets[slot].name_len = name_len;
+        buckets[slot].offset = fp->offset;
+    }
+
+    write(out_fd, &index, sizeof(index));
+    write(out_fd, buckets, nbuckets * sizeof(*buckets));
+    write_pad(out_fd, index.length - sizeof(index) -
+        (nbuckets * sizeof(*buckets)));
+
+    free(buckets);
+    return 0;
+}
+
+/*
+ * Copy a range of one file to the current offset of
+ * another, the copy is left to the host where it can
+ * share blocks between them.
+ */
+static int
+copy_range(int out_fd, int in_fd, off_t off, size_t len)
+{
+    char buf[PAGE_ALIGN];
+    ssize_t n;
+
+    while (len > 0) {
+        n = copy_file_range(in_fd, &off, out_fd, NULL, len, 0);
+        if (n <= 0) {
+            break;
+        }
+
+        len -= n;
+    }
+
+    /* Fall back to a plain copy */
+    while (len > 0) {
+        n = pread(in_fd, buf, (len > sizeof(buf)) ? sizeof(buf) : len, off);
+        if (n <= 0 || write(out_fd, buf, n) != n) {
+            return -1;
+        }
+
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int
+write_file(int out_fd, struct memar_file *fp)
+{
+    struct file_hdr hdr;
+    size_t align, hdr_len;
+    int fd, error = 0;
+
+    /* Initialize the header */
+    file_hdr_init(fp, &hdr);
+    hdr_len = sizeof(hdr) - FILE_NAME_MAX + hdr.fname_size;
+    align = (size_t)1 << fp->align_shift;
+
+    /* Write the header + padding */
+    write(out_fd, &hdr, hdr_len);
+    write_pad(out_fd, hdr.hdr_size - hdr_len);
+
+    /* Then the file + padding, unless it is shared */
+    if (fp->dup != NULL) {
+        return 0;
+    } else if (fp->reuse != 0) {
+        error = copy_range(out_fd, prev_fd, fp->reuse, fp->stored);
+    } else if (fp->zdata != NULL) {
+        write(out_fd, fp->zdata, fp->stored);
+    } else if (fp->stored > 0) {
+        if ((fd = open(fp->path, O_RDONLY)) < 0) {
+            perror("open");
+            return -1;
+        }
+
+        error = copy_range(out_fd, fd, 0, fp->stored);
+        close(fd);
+    }
+
+    if (error != 0) {
+        printf("could not copy \"%s\"\n", fp->path);
+        return error;
+    }
+
+    write_pad(out_fd, ALIGN_UP(fp->stored, align) - fp->stored);
+    return 0;
 }
 
 static void
-concat_foreach(int dirfd, int out_fd, const char *path)
+concat_foreach(int dirfd, const char *path)
 {
     int subdir_fd;
     char pathbuf[PATH_MAX];
@@ -202,13 +1108,12 @@ concat_foreach(int dirfd, int out_fd, const char *path)
             }
 
             printf("[d] %s\n", pathbuf);
-            concat_foreach(subdir_fd, out_fd, pathbuf);
-            close(subdir_fd);
+            concat_foreach(subdir_fd, pathbuf);
             break;
         case DT_REG:
             snprintf(pathbuf, sizeof(pathbuf), "%s/%s", path, dirent->d_name);
             printf("[f] %s\n", pathbuf);
-            write_file(out_fd, pathbuf);
+            add_file(pathbuf);
             break;
         }
     }
@@ -223,8 +1128,10 @@ concat_foreach(int dirfd, int out_fd, const char *path)
 static void
 dir_concat(void)
 {
+    char tmp_path[PATH_MAX];
     struct stat statb;
-    int fd, out_fd;
+    size_t nreused = 0, ndup;
+    int fd, out_fd, error;
 
     fd = open(input_dir, O_RDONLY);
     if (fd < 0) {
@@ -232,14 +1139,6 @@ dir_concat(void)
         return;
     }
 
-    /* Create the output file */
-    out_fd = open(output_file, O_WRONLY | O_CREAT, 0666);
-    if (out_fd < 0) {
-        perror("open[output]");
-        close(fd);
-        return;
-    }
-
     if (fstat(fd, &statb) < 0) {
         perror("fstat");
         return;
@@ -250,17 +1149,57 @@ dir_concat(void)
         return;
     }
 
-    concat_foreach(fd, out_fd, input_dir);
+    /* Collect every file first, the index covers all of them */
+    concat_foreach(fd, input_dir);
+    qsort(files, nfiles, sizeof(*files), file_cmp);
+
+    prev_open();
+    if (stage_files() != 0) {
+        prev_close();
+        return;
+    }
+
+    ndup = dedup_files();
+
+    /* The previous archive is read from until we are done */
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", output_file);
+    out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd < 0) {
+        perror("open[output]");
+        prev_close();
+        return;
+    }
+
+    error = write_index(out_fd);
+    for (size_t i = 0; i < nfiles && error == 0; ++i) {
+        error = write_file(out_fd, &files[i]);
+        if (files[i].reuse != 0)
+            ++nreused;
+    }
+
     close(out_fd);
-    close(fd);
+    prev_close();
+    if (error != 0) {
+        unlink(tmp_path);
+        return;
+    }
+
+    if (rename(tmp_path, output_file) < 0) {
+        perror("rename");
+        unlink(tmp_path);
+        return;
+    }
+
+    printf("%zu files, %zu reused, %zu shared\n", nfiles, nreused, ndup);
 }
 
 int
 main(int argc, char **argv)
 {
+    char **tmp;
     int opt;
 
-    while ((opt = getopt(argc, argv, "hi:o:")) != -1) {
+    while ((opt = getopt(argc, argv, "hi:o:aep:zj:")) != -1) {
         switch (opt) {
         case 'h':
             help();
@@ -271,6 +1210,29 @@ main(int argc, char **argv)
         case 'o':
             output_file = strdup(optarg);
             break;
+        case 'a':
+            align_policy = ALIGN_ALL;
+            break;
+        case 'e':
+            if (align_policy != ALIGN_ALL)
+                align_policy = ALIGN_ELF;
+            break;
+        case 'p':
+            tmp = realloc(align_names, (nalign_names + 1) * sizeof(*tmp));
+            if (tmp == NULL) {
+                perror("realloc");
+                return -1;
+            }
+
+            align_names = tmp;
+            align_names[nalign_names++] = strdup(optarg);
+            break;
+        case 'z':
+            compress = 1;
+            break;
+        case 'j':
+            nthreads = strtoul(optarg, NULL, 0);
+            break;
         }
     }
 
@@ -44,8 +44,8 @@ atomic_add_int_nv(volatile unsigned int *p, unsigned int v)
     return __sync_add_and_fetch(p, v);
 }
 
-static inline unsigned int
-atomic_add_64_nv(volatile uint64_t *p, unsigned int v)
+static inline uint64_t
+atomic_add_64_nv(volatile uint64_t *p, uint64_t v)
 {
     return __sync_add_and_fetch(p, v);
 }
@@ -62,8 +62,8 @@ atomic_sub_int_nv(volatile unsigned int *p, unsigned int v)
     return __sync_sub_and_fetch(p, v);
 }
 
-static inline unsigned int
-atomic_sub_64_nv(volatile uint64_t *p, unsigned int v)
+static inline uint64_t
+atomic_sub_64_nv(volatile uint64_t *p, uint64_t v)
 {
     return __sync_sub_and_fetch(p, v);
 }
@@ -80,7 +80,7 @@ atomic_load_long_nv(volatile unsigned long *p, unsigned int v)
     return __atomic_load_n(p, v);
 }
 
-static inline unsigned int
+static inline uint64_t
 atomic_load_64_nv(volatile uint64_t *p, unsigned int v)
 {
     return __atomic_load_n(p, v);
@@ -104,6 +104,31 @@ atomic_store_64_nv(volatile uint64_t *p, long nv, unsigned int v)
     __atomic_store_n(p, nv, v);
 }
 
+static inline void
+atomic_set_64(volatile uint64_t *p, uint64_t bits)
+{
+    __atomic_fetch_or(p, bits, __ATOMIC_SEQ_CST);
+}
+
+static inline void
+atomic_clear_64(volatile uint64_t *p, uint64_t bits)
+{
+    __atomic_fetch_and(p, ~bits, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Store 'nv' if '*p' still holds 'old', returns
+ * nonzero on success.
+ */
+static inline int
+atomic_cas_int(volatile unsigned int *p, unsigned int old, unsigned int nv)
+{
+    return __sync_bool_compare_and_swap(p, old, nv);
+}
+
+#define atomic_cas_ptr(P, OLD, NV) \
+    __sync_bool_compare_and_swap((P), (OLD), (NV))
+
 /* Atomic increment (and fetch) operations */
 #define atomic_inc_long(P) atomic_add_long_nv((P), 1)
 #define atomic_inc_int(P) atomic_add_int_nv((P), 1)
@@ -124,4 +149,23 @@ atomic_store_64_nv(volatile uint64_t *p, long nv, unsigned int v)
 #define atomic_store_long(P, NV) atomic_store_long_nv((P), (NV), __ATOMIC_SEQ_CST)
 #define atomic_store_64(P, NV) atomic_store_64_nv((P), (NV), __ATOMIC_SEQ_CST)
 
+/*
+ * Publish a pointer after everything it points to has
+ * been set up, the matching load only needs ordering
+ * against what it dereferences.
+ */
+#define atomic_store_release(P, NV) \
+    __atomic_store_n((P), (NV), __ATOMIC_RELEASE)
+#define atomic_load_consume(P) __atomic_load_n((P), __ATOMIC_CONSUME)
+#define atomic_load_acquire(P) __atomic_load_n((P), __ATOMIC_ACQUIRE)
+
+/* Orders prior loads against everything after it */
+#define atomic_fence_acquire() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+/* Full memory barrier */
+#define atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* Compiler only barrier, orders against the current processor */
+#define atomic_barrier() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
 #endif  /* !_SYS_ATOMIC_H_ */
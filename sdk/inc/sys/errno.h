@@ -60,5 +60,6 @@
 #define	EROFS 30	/* Read only file system */
 #define ENAMETOOLONG 31
 #define ENOTSUP 32
+#define ENOSYS 33
 
 #endif  /* !_SYS_ERRNO_H_ */
@@ -38,6 +38,20 @@
 #define PROT_EXEC  BIT(1)       /* Executable */
 #if defined(_HIVE)
 #define PROT_USER  BIT(2)       /* User */
+#define PROT_COW   BIT(3)       /* Copy-on-write */
+#define PROT_WC    BIT(4)       /* Write-combining */
+#define PROT_UC    BIT(5)       /* Uncacheable */
+#define PROT_WT    BIT(6)       /* Write-through */
 #endif  /* _HIVE */
 
+/* Mapping flags */
+#define MAP_SHARED   BIT(0)     /* Share with clones */
+#define MAP_PRIVATE  BIT(1)     /* Private copy-on-write */
+#define MAP_ANON     BIT(2)     /* Anonymous zeroed memory */
+#define MAP_FIXED    BIT(3)     /* Map exactly at the address */
+#define MAP_POPULATE BIT(4)     /* Prefault the whole mapping */
+#define MAP_HUGE     BIT(5)     /* Prefer 2 MiB pages */
+
+#define MAP_FAILED ((void *)-1)
+
 #endif  /* _SYS_MMAN_H_ */
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2025 Ian Marco Moffett and the OpenModality engineers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SYS_SYSCALL_H_
+#define _SYS_SYSCALL_H_ 1
+
+#include <sys/types.h>
+#include <sys/cdefs.h>
+
+/*
+ * System call numbers, passed in %rax through
+ * 'int $0x80' with arguments in %rdi, %rsi, %rdx,
+ * %r10, %r8 and %r9. The result is returned in %rax
+ * and is a negated errno value on failure.
+ */
+#define SYS_mmap    1
+#define SYS_munmap  2
+
+#define SYSCALL_VECTOR 0x80
+
+#if !defined(_HIVE)
+ALWAYS_INLINE static inline long
+syscall2(uint64_t num, uint64_t arg0, uint64_t arg1)
+{
+    long ret;
+
+    ASMV(
+        "int $0x80"
+        : "=a" (ret)
+        : "a" (num), "D" (arg0), "S" (arg1)
+        : "memory"
+    );
+
+    return ret;
+}
+
+ALWAYS_INLINE static inline long
+syscall6(uint64_t num, uint64_t arg0, uint64_t arg1, uint64_t arg2,
+    uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+    register uint64_t r10 __asm__("r10") = arg3;
+    register uint64_t r8 __asm__("r8") = arg4;
+    register uint64_t r9 __asm__("r9") = arg5;
+    long ret;
+
+    ASMV(
+        "int $0x80"
+        : "=a" (ret)
+        : "a" (num), "D" (arg0), "S" (arg1), "d" (arg2),
+          "r" (r10), "r" (r8), "r" (r9)
+        : "memory"
+    );
+
+    return ret;
+}
+#endif  /* !_HIVE */
+
+#endif  /* !_SYS_SYSCALL_H_ */
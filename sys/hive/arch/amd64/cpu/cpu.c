@@ -32,13 +32,32 @@
 #include <mu/cpu.h>
 #include <md/msr.h>
 
+static struct pcr *pcr_list[CPU_MAX];
+
+struct pcr *
+mu_cpu_self(void)
+{
+    return (struct pcr *)md_rdmsr(IA32_GS_BASE);
+}
+
+struct pcr *
+mu_cpu_get(uint16_t id)
+{
+    if (id >= CPU_MAX) {
+        return NULL;
+    }
+
+    return pcr_list[id];
+}
+
 void
 mu_cpu_conf(struct pcr *pcr)
 {
-    if (pcr == NULL) {
+    if (pcr == NULL || pcr->id >= CPU_MAX) {
         return;
     }
 
+    pcr_list[pcr->id] = pcr;
     md_wrmsr(IA32_GS_BASE, (uintptr_t)pcr);
     printf("cpu: processing element %d active\n", pcr->id);
 }
@@ -29,11 +29,15 @@
 
 #include <sys/param.h>
 #include <sys/units.h>
+#include <sys/atomic.h>
 #include <mu/pmap.h>
+#include <mu/cpu.h>
 #include <mm/pmem.h>
 #include <mm/memvar.h>
 #include <lib/stdbool.h>
 #include <lib/string.h>
+#include <core/panic.h>
+#include <md/msr.h>
 
 /*
  * Page-Table Entry (PTE) flags
@@ -49,11 +53,38 @@
 #define PTE_ACC         BIT(5)        /* Accessed */
 #define PTE_DIRTY       BIT(6)        /* Dirty (written-to page) */
 #define PTE_PS          BIT(7)        /* Page size */
+#define PTE_PAT         BIT(7)        /* Page attribute table (4K leaf) */
 #define PTE_GLOBAL      BIT(8)        /* Global / sticky map */
+#define PTE_COW         BIT(9)        /* Copy-on-write (software) */
+#define PTE_PAT_PS      BIT(12)       /* Page attribute table (huge leaf) */
 #define PTE_NX          BIT(63)       /* Execute-disable */
 
+/*
+ * Page attribute table layout, matches the one the loader
+ * sets up so its mappings keep their memory types.
+ *
+ * PA0: WB   PA1: WT   PA2: UC-  PA3: UC
+ * PA4: WP   PA5: WC   PA6: UC-  PA7: UC
+ *
+ * A 4K leaf selects an entry through its PAT, PCD and PWT
+ * bits (in that order, most significant first).
+ */
+#define PAT_LAYOUT  0x0007010500070406ULL
+#define PTE_CACHE_WT    (PTE_PWT)
+#define PTE_CACHE_UC    (PTE_PCD | PTE_PWT)
+#define PTE_CACHE_WC    (PTE_PAT | PTE_PWT)
+#define PTE_CACHE_MASK  (PTE_PAT | PTE_PCD | PTE_PWT)
+
+#define CR4_PGE  BIT(7)   /* Global pages */
 #define CR4_LA57 BIT(12)  /* 5-level paging */
 
+/*
+ * Number of entries within a paging structure, the
+ * upper half of the top level maps the kernel.
+ */
+#define PMAP_NENTRIES   512
+#define PMAP_KERN_START (PMAP_NENTRIES / 2)
+
 /*
  * Represents various paging structure
  * levels for translation
@@ -76,22 +107,74 @@ static size_t mem_pstab[] = {
     [PAGESIZE_1G] = UNIT_GIB
 };
 
+/* Kernel virtual address space */
+static struct mu_vas kvas;
+
+/* Paging mode, detected once by pmap_toplevel() */
+static pmap_level_t paging_top = PMAP_PML1;
+
 /*
  * Returns true if the given pagesize is valid.
- *
- * TODO: Support huge pages
  */
 static inline bool
 is_ps_valid(pagesize_t size)
 {
     switch (size) {
     case PAGESIZE_4K:
+    case PAGESIZE_2M:
         return true;
+    default:
+        break;
     }
 
     return false;
 }
 
+/*
+ * Returns the paging structure level a leaf of
+ * the given page size lives at.
+ */
+static inline pmap_level_t
+ps_to_level(pagesize_t ps)
+{
+    switch (ps) {
+    case PAGESIZE_2M:
+        return PMAP_PML2;
+    case PAGESIZE_1G:
+        return PMAP_PML3;
+    default:
+        break;
+    }
+
+    return PMAP_PML1;
+}
+
+static inline uint64_t
+pmap_read_cr4(void)
+{
+    uint64_t cr4;
+
+    ASMV(
+        "mov %%cr4, %0"
+        : "=r" (cr4)
+        :
+        : "memory"
+    );
+
+    return cr4;
+}
+
+static inline void
+pmap_write_cr4(uint64_t cr4)
+{
+    ASMV(
+        "mov %0, %%cr4"
+        :
+        : "r" (cr4)
+        : "memory"
+    );
+}
+
 /*
  * Acquire the index of the top-level that
  * the CR3 register references
@@ -101,14 +184,42 @@ pmap_toplevel(void)
 {
     uint64_t cr4;
 
+    /* The paging mode never changes once we are up */
+    if (paging_top != PMAP_PML1) {
+        return paging_top;
+    }
+
+    cr4 = pmap_read_cr4();
+    paging_top = ISSET(cr4, CR4_LA57) ? PMAP_PML5 : PMAP_PML4;
+    return paging_top;
+}
+
+/*
+ * Program the page attribute table of the current
+ * processor.
+ */
+static void
+pmap_init_pat(void)
+{
+    md_wrmsr(IA32_PAT, PAT_LAYOUT);
+
+    /* Nothing cached may keep a stale memory type */
     ASMV(
-        "mov %%cr4, %0"
-        : "=r" (cr4)
+        "wbinvd"
+        :
         :
         : "memory"
     );
+}
 
-    return ISSET(cr4, CR4_LA57) ? PMAP_PML5 : PMAP_PML4;
+/*
+ * Returns true if the virtual address lies within
+ * the kernel half.
+ */
+static inline bool
+pmap_is_kernel(uintptr_t vma)
+{
+    return ISSET(vma, BIT(63));
 }
 
 static inline void
@@ -122,6 +233,108 @@ pmap_invlpg(uintptr_t vma)
     );
 }
 
+/*
+ * Flush every non-global TLB entry on the
+ * current processor.
+ */
+static inline void
+pmap_flush_tlb(void)
+{
+    uint64_t cr3;
+
+    ASMV(
+        "mov %%cr3, %0\n\t"
+        "mov %0, %%cr3"
+        : "=r" (cr3)
+        :
+        : "memory"
+    );
+}
+
+/*
+ * Flush every TLB entry on the current processor,
+ * global ones included. Toggling CR4.PGE is the only
+ * way to drop global entries short of invlpg.
+ */
+static inline void
+pmap_flush_tlb_global(void)
+{
+    uint64_t cr4;
+
+    cr4 = pmap_read_cr4();
+    if (!ISSET(cr4, CR4_PGE)) {
+        pmap_flush_tlb();
+        return;
+    }
+
+    pmap_write_cr4(cr4 & ~CR4_PGE);
+    pmap_write_cr4(cr4);
+}
+
+/*
+ * The walk cache remembers which leaf table covers a 2 MiB
+ * span of a virtual address space. It is direct mapped by
+ * the low bits of the span number, each entry packs the
+ * remaining span bits above the frame number of the table
+ * so that it is read and written as a single word and never
+ * needs a lock.
+ *
+ * Leaf tables are only ever freed when the whole address
+ * space is torn down so an entry stays valid until then.
+ */
+#define WALK_SPAN_SHIFT 21
+#define WALK_INDEX(VA) (((VA) >> WALK_SPAN_SHIFT) & (MD_WALK_CACHE_SIZE - 1))
+#define WALK_TAG(VA) ((uint32_t)((VA) >> WALK_SPAN_SHIFT >> 4))
+#define WALK_PFN_MAX 0xFFFFFFFFULL
+
+static uint64_t *
+pmap_walk_lookup(struct mu_vas *vas, uintptr_t vma)
+{
+    uint64_t ent;
+
+    ent = vas->walk_cache[WALK_INDEX(vma)];
+    if ((uint32_t)ent == 0 || (ent >> 32) != WALK_TAG(vma)) {
+        return NULL;
+    }
+
+    return PHYS_TO_VIRT((ent & WALK_PFN_MAX) << 12);
+}
+
+static void
+pmap_walk_fill(struct mu_vas *vas, uintptr_t vma, uint64_t *tbl)
+{
+    uintptr_t pfn;
+
+    /* Tables out of reach of the tag are just not cached */
+    pfn = VIRT_TO_PHYS(tbl) >> 12;
+    if (pfn > WALK_PFN_MAX) {
+        return;
+    }
+
+    vas->walk_cache[WALK_INDEX(vma)] = ((uint64_t)WALK_TAG(vma) << 32) | pfn;
+}
+
+static void
+pmap_walk_flush(struct mu_vas *vas)
+{
+    for (size_t i = 0; i < MD_WALK_CACHE_SIZE; ++i) {
+        vas->walk_cache[i] = 0;
+    }
+}
+
+/*
+ * Returns the logical ID of the current processor,
+ * before the BSP is configured this is always zero.
+ */
+static inline uint16_t
+pmap_cpu_id(void)
+{
+    struct pcr *self;
+
+    self = mu_cpu_self();
+    return (self != NULL) ? self->id : 0;
+}
+
 int
 mu_pmap_readvas(struct mu_vas *res)
 {
@@ -136,16 +349,39 @@ mu_pmap_readvas(struct mu_vas *res)
         : "memory"
     );
 
+    res->cpumask = BIT(pmap_cpu_id());
+    res->map = NULL;
+    pmap_walk_flush(res);
     return 0;
 }
 
 int
 mu_pmap_writevas(struct mu_vas *vas)
 {
+    struct pcr *self;
+    struct mu_vas *prev = NULL;
+    uint16_t id;
+
     if (vas == NULL) {
         return -1;
     }
 
+    self = mu_cpu_self();
+    id = (self != NULL) ? self->id : 0;
+    if (self != NULL) {
+        prev = self->curvas;
+        self->curvas = vas;
+    }
+
+    /*
+     * Keep track of which processors have which VAS loaded
+     * so that shootdowns can skip the ones that do not.
+     */
+    if (prev != NULL && prev != vas) {
+        atomic_clear_64(&prev->cpumask, BIT(id));
+    }
+    atomic_set_64(&vas->cpumask, BIT(id));
+
     ASMV(
         "mov %0, %%cr3"
         :
@@ -172,9 +408,86 @@ prot_to_pte(uint16_t prot)
     if (ISSET(prot, PROT_USER))
         pte_flags |= PTE_US;
 
+    /* Shared frames must fault on write */
+    if (ISSET(prot, PROT_COW)) {
+        pte_flags &= ~PTE_RW;
+        pte_flags |= PTE_COW;
+    }
+
+    /* Memory type, write-back unless asked otherwise */
+    if (ISSET(prot, PROT_UC)) {
+        pte_flags |= PTE_CACHE_UC;
+    } else if (ISSET(prot, PROT_WC)) {
+        pte_flags |= PTE_CACHE_WC;
+    } else if (ISSET(prot, PROT_WT)) {
+        pte_flags |= PTE_CACHE_WT;
+    }
+
     return pte_flags;
 }
 
+/*
+ * Convert machine page table bits into system
+ * protection flags
+ */
+static inline int
+pte_to_prot(uint64_t pte)
+{
+    int prot = PROT_READ;
+
+    if (ISSET(pte, PTE_RW))
+        prot |= PROT_WRITE;
+    if (!ISSET(pte, PTE_NX))
+        prot |= PROT_EXEC;
+    if (ISSET(pte, PTE_US))
+        prot |= PROT_USER;
+    if (ISSET(pte, PTE_COW))
+        prot |= PROT_COW;
+
+    switch (pte & PTE_CACHE_MASK) {
+    case PTE_CACHE_UC:
+        prot |= PROT_UC;
+        break;
+    case PTE_CACHE_WC:
+        prot |= PROT_WC;
+        break;
+    case PTE_CACHE_WT:
+        prot |= PROT_WT;
+        break;
+    }
+
+    return prot;
+}
+
+/*
+ * Convert the bits of a 4K leaf into those of a huge
+ * leaf, the PAT bit moves to make room for PS.
+ */
+static inline uint64_t
+pte_to_huge(uint64_t pte)
+{
+    if (ISSET(pte, PTE_PAT)) {
+        pte = (pte & ~PTE_PAT) | PTE_PAT_PS;
+    }
+
+    return pte | PTE_PS;
+}
+
+/*
+ * Convert the bits of a huge leaf into those of
+ * a 4K leaf.
+ */
+static inline uint64_t
+pte_from_huge(uint64_t pte)
+{
+    pte &= ~PTE_PS;
+    if (ISSET(pte, PTE_PAT_PS)) {
+        pte = (pte & ~PTE_PAT_PS) | PTE_PAT;
+    }
+
+    return pte;
+}
+
 /*
  * Extract a paging structure level index from a
  * virtual memory address for translation.
@@ -183,7 +496,7 @@ static size_t
 vma_level_index(uintptr_t vma, pmap_level_t level)
 {
     switch (level) {
-    case PMAP_PML5: return (vma >> 47) & 0x3FF;
+    case PMAP_PML5: return (vma >> 48) & 0x1FF;
     case PMAP_PML4: return (vma >> 39) & 0x1FF;
     case PMAP_PML3: return (vma >> 30) & 0x1FF;
     case PMAP_PML2: return (vma >> 21) & 0x1FF;
@@ -210,6 +523,10 @@ vma_level_base(struct mu_vas *vas, uintptr_t vma, pmap_level_t lvl, bool alloc)
         return NULL;
     }
 
+    if (lvl == PMAP_PML1 && (cur_base = pmap_walk_lookup(vas, vma)) != NULL) {
+        return cur_base;
+    }
+
     /* Acquire the top-level structure */
     phys = vas->cr3 & PTE_ADDR_MASK;
     cur_base = PHYS_TO_VIRT(phys);
@@ -217,6 +534,11 @@ vma_level_base(struct mu_vas *vas, uintptr_t vma, pmap_level_t lvl, bool alloc)
     while (cur_lvl > lvl) {
         index = vma_level_index(vma, cur_lvl);
 
+        /* Huge leaves have nothing below them */
+        if (ISSET(cur_base[index], PTE_P | PTE_PS) == (PTE_P | PTE_PS)) {
+            return NULL;
+        }
+
         /* Is this entry present? */
         if (ISSET(cur_base[index], PTE_P)) {
             phys = cur_base[index] & PTE_ADDR_MASK;
@@ -245,46 +567,724 @@ vma_level_base(struct mu_vas *vas, uintptr_t vma, pmap_level_t lvl, bool alloc)
         --cur_lvl;
     }
 
+    if (lvl == PMAP_PML1) {
+        pmap_walk_fill(vas, vma, cur_base);
+    }
+
     return cur_base;
 }
 
+/*
+ * Locate the leaf entry that translates a virtual memory
+ * address, huge pages included. Its size is written to
+ * 'ps'.
+ */
+static uint64_t *
+pmap_leaf(struct mu_vas *vas, uintptr_t vma, pagesize_t *ps)
+{
+    pmap_level_t cur_lvl = pmap_toplevel();
+    uintptr_t *cur_base;
+    uint64_t *pte;
+
+    /* A cached leaf table means no huge page is in the way */
+    if ((cur_base = pmap_walk_lookup(vas, vma)) != NULL) {
+        pte = &cur_base[vma_level_index(vma, PMAP_PML1)];
+        *ps = PAGESIZE_4K;
+        return ISSET(*pte, PTE_P) ? pte : NULL;
+    }
+
+    cur_base = PHYS_TO_VIRT(vas->cr3 & PTE_ADDR_MASK);
+    for (;;) {
+        pte = &cur_base[vma_level_index(vma, cur_lvl)];
+        if (!ISSET(*pte, PTE_P)) {
+            return NULL;
+        }
+
+        if (cur_lvl == PMAP_PML1) {
+            pmap_walk_fill(vas, vma, cur_base);
+            *ps = PAGESIZE_4K;
+            return pte;
+        }
+
+        if (ISSET(*pte, PTE_PS)) {
+            *ps = (cur_lvl == PMAP_PML2) ? PAGESIZE_2M : PAGESIZE_1G;
+            return pte;
+        }
+
+        cur_base = PHYS_TO_VIRT(*pte & PTE_ADDR_MASK);
+        --cur_lvl;
+    }
+}
+
+/*
+ * Invalidate the ranges of a gather on the
+ * current processor.
+ */
+static void
+pmap_flush_local(struct pmap_gather *pg)
+{
+    uintptr_t va;
+
+    if (pg->flush_all) {
+        if (pg->kernel) {
+            pmap_flush_tlb_global();
+        } else {
+            pmap_flush_tlb();
+        }
+
+        return;
+    }
+
+    for (size_t i = 0; i < pg->nrange; ++i) {
+        va = pg->range[i].va;
+        for (size_t off = 0; off < pg->range[i].len; off += PAGESIZE) {
+            pmap_invlpg(va + off);
+        }
+    }
+}
+
+/*
+ * Shoot down stale translations on every other processor
+ * within the 'targets' mask.
+ *
+ * Only the BSP is ever brought up and there is no way to
+ * send IPIs yet, so no other processor may be running.
+ * Bits of processors that were never configured are left
+ * over from kernel wide flushes and need nothing.
+ */
+static void
+pmap_shootdown(uint64_t targets)
+{
+    for (uint16_t i = 0; i < CPU_MAX && targets != 0; ++i) {
+        if (!ISSET(targets, BIT(i))) {
+            continue;
+        }
+
+        targets &= ~BIT(i);
+        if (mu_cpu_get(i) != NULL) {
+            panic("pmap: cannot shoot down cpu %d\n", i);
+        }
+    }
+}
+
+void
+mu_pmap_gather_init(struct pmap_gather *pg, struct mu_vas *vas)
+{
+    if (pg == NULL) {
+        return;
+    }
+
+    pg->vas = vas;
+    pg->nrange = 0;
+    pg->npages = 0;
+    pg->kernel = false;
+    pg->flush_all = false;
+}
+
+void
+mu_pmap_gather_add(struct pmap_gather *pg, uintptr_t va, size_t len)
+{
+    size_t n;
+
+    if (pg == NULL || len == 0) {
+        return;
+    }
+
+    /* The kernel half is shared by every VAS */
+    if (pmap_is_kernel(va)) {
+        pg->kernel = true;
+    }
+
+    pg->npages += ALIGN_UP(len, PAGESIZE) / PAGESIZE;
+    if (pg->flush_all) {
+        return;
+    }
+
+    if (pg->npages >= PMAP_INVL_THRESH) {
+        pg->flush_all = true;
+        return;
+    }
+
+    /* Coalesce with the last range if we can */
+    if ((n = pg->nrange) > 0) {
+        if (pg->range[n - 1].va + pg->range[n - 1].len == va) {
+            pg->range[n - 1].len += len;
+            return;
+        }
+    }
+
+    if (n >= PMAP_GATHER_MAX) {
+        pg->flush_all = true;
+        return;
+    }
+
+    pg->range[n].va = va;
+    pg->range[n].len = len;
+    ++pg->nrange;
+}
+
+void
+mu_pmap_gather_flush(struct pmap_gather *pg)
+{
+    struct mu_vas *vas;
+    uint64_t targets, self_bit;
+
+    if (pg == NULL || (vas = pg->vas) == NULL) {
+        return;
+    }
+
+    if (pg->npages == 0) {
+        return;
+    }
+
+    /*
+     * Kernel mappings are live everywhere, otherwise only
+     * processors that have this VAS loaded need to flush.
+     * The rest are skipped: PCIDs are not used, so their
+     * next CR3 load drops every non-global entry anyway.
+     */
+    self_bit = BIT(pmap_cpu_id());
+    targets = pg->kernel ? (uint64_t)-1 : vas->cpumask;
+    if (ISSET(targets, self_bit)) {
+        pmap_flush_local(pg);
+    }
+
+    pmap_shootdown(targets & ~self_bit);
+    mu_pmap_gather_init(pg, vas);
+}
+
 int
-mu_pmap_map(struct mu_vas *vas, uintptr_t vma, uintptr_t pma, int prot,
+mu_pmap_enter(struct pmap_gather *pg, uintptr_t vma, uintptr_t pma, int prot,
+    pagesize_t ps)
+{
+    pmap_level_t lvl;
+    uintptr_t *pgtbl;
+    size_t index, old, pte;
+
+    if (pg == NULL || !is_ps_valid(ps)) {
+        return -1;
+    }
+
+    lvl = ps_to_level(ps);
+    vma = ALIGN_DOWN(vma, mem_pstab[ps]);
+    pma = ALIGN_DOWN(pma, mem_pstab[ps]);
+    pgtbl = vma_level_base(pg->vas, vma, lvl, true);
+    if (pgtbl == NULL) {
+        return -1;
+    }
+
+    index = vma_level_index(vma, lvl);
+    old = pgtbl[index];
+
+    /* Never drop a table of smaller pages for a huge one */
+    if (lvl != PMAP_PML1 && ISSET(old, PTE_P) && !ISSET(old, PTE_PS)) {
+        return -1;
+    }
+
+    /* Kernel mappings survive CR3 loads */
+    pte = pma | prot_to_pte(prot);
+    if (pmap_is_kernel(vma)) {
+        pte |= PTE_GLOBAL;
+    }
+
+    pgtbl[index] = (lvl != PMAP_PML1) ? pte_to_huge(pte) : pte;
+
+    /*
+     * Non-present entries are never cached by the TLB so
+     * only translations we replaced need invalidating.
+     */
+    if (ISSET(old, PTE_P)) {
+        mu_pmap_gather_add(pg, vma, mem_pstab[ps]);
+    }
+
+    return 0;
+}
+
+int
+mu_pmap_remove(struct pmap_gather *pg, uintptr_t vma, pagesize_t ps)
+{
+    pmap_level_t lvl;
+    uintptr_t *pgtbl;
+    size_t index, old;
+
+    if (pg == NULL || !is_ps_valid(ps)) {
+        return -1;
+    }
+
+    lvl = ps_to_level(ps);
+    vma = ALIGN_DOWN(vma, mem_pstab[ps]);
+    pgtbl = vma_level_base(pg->vas, vma, lvl, false);
+    if (pgtbl == NULL) {
+        return 0;
+    }
+
+    index = vma_level_index(vma, lvl);
+    old = pgtbl[index];
+    if (lvl != PMAP_PML1 && ISSET(old, PTE_P) && !ISSET(old, PTE_PS)) {
+        return -1;
+    }
+
+    pgtbl[index] = 0;
+    if (ISSET(old, PTE_P)) {
+        mu_pmap_gather_add(pg, vma, mem_pstab[ps]);
+    }
+
+    return 0;
+}
+
+int
+mu_pmap_protect(struct pmap_gather *pg, uintptr_t vma, int prot,
     pagesize_t ps)
 {
+    pmap_level_t lvl;
     uintptr_t *pgtbl;
-    size_t index, pte_flags;
+    size_t index, old, pte;
 
-    if (vas == NULL || !is_ps_valid(ps)) {
+    if (pg == NULL || !is_ps_valid(ps)) {
         return -1;
     }
 
+    lvl = ps_to_level(ps);
     vma = ALIGN_DOWN(vma, mem_pstab[ps]);
-    pgtbl = vma_level_base(vas, vma, PMAP_PML1, true);
+    pgtbl = vma_level_base(pg->vas, vma, lvl, false);
+    if (pgtbl == NULL) {
+        return -1;
+    }
+
+    index = vma_level_index(vma, lvl);
+    old = pgtbl[index];
+    if (!ISSET(old, PTE_P)) {
+        return -1;
+    }
+
+    if (lvl != PMAP_PML1 && !ISSET(old, PTE_PS)) {
+        return -1;
+    }
+
+    /* Shared frames stay write protected */
+    if (ISSET(old, PTE_COW)) {
+        prot |= PROT_COW;
+    }
+
+    pte = prot_to_pte(prot) | (old & PTE_GLOBAL);
+    if (lvl != PMAP_PML1) {
+        pte = pte_to_huge(pte);
+    }
+
+    pgtbl[index] = (old & PTE_ADDR_MASK & ~(mem_pstab[ps] - 1)) | pte;
+    mu_pmap_gather_add(pg, vma, mem_pstab[ps]);
+    return 0;
+}
+
+int
+mu_pmap_demote(struct pmap_gather *pg, uintptr_t vma)
+{
+    uintptr_t *pgtbl, *ptes, phys, base;
+    uint64_t pte, flags;
+    size_t index;
+
+    if (pg == NULL || pg->vas == NULL) {
+        return -1;
+    }
+
+    vma = ALIGN_DOWN(vma, mem_pstab[PAGESIZE_2M]);
+    pgtbl = vma_level_base(pg->vas, vma, PMAP_PML2, false);
     if (pgtbl == NULL) {
         return -1;
     }
 
-    pte_flags = prot_to_pte(prot);
-    index = vma_level_index(vma, PMAP_PML1);
-    pgtbl[index] = pma | pte_flags;
-    pmap_invlpg(vma);
+    index = vma_level_index(vma, PMAP_PML2);
+    pte = pgtbl[index];
+    if (ISSET(pte, PTE_P | PTE_PS) != (PTE_P | PTE_PS)) {
+        return -1;
+    }
+
+    if ((phys = mm_pmem_alloc(1)) == 0) {
+        return -1;
+    }
+
+    /* Same frames, same attributes, just smaller pages */
+    base = pte & PTE_ADDR_MASK & ~(mem_pstab[PAGESIZE_2M] - 1);
+    flags = pte_from_huge(pte) & ~PTE_ADDR_MASK;
+    ptes = PHYS_TO_VIRT(phys);
+    for (size_t i = 0; i < PMAP_NENTRIES; ++i) {
+        ptes[i] = (base + (i * PAGESIZE)) | flags;
+    }
+
+    pgtbl[index] = phys | (PTE_P | PTE_RW | PTE_US);
+    mu_pmap_gather_add(pg, vma, mem_pstab[PAGESIZE_2M]);
+    return 0;
+}
+
+/*
+ * Share the frames of a leaf between two address spaces,
+ * returns the updated leaf.
+ */
+static uint64_t
+pmap_share_leaf(struct pmap_gather *pg, uintptr_t va, uint64_t pte,
+    pagesize_t ps, bool cow)
+{
+    uintptr_t base;
+
+    /*
+     * If copy-on-write, write protect it in the source too
+     * so that whoever writes first gets their own copy.
+     */
+    if (cow) {
+        if (ISSET(pte, PTE_RW)) {
+            mu_pmap_gather_add(pg, va, mem_pstab[ps]);
+        }
+
+        pte = (pte & ~PTE_RW) | PTE_COW;
+    }
+
+    base = pte & PTE_ADDR_MASK & ~(mem_pstab[ps] - 1);
+    for (size_t off = 0; off < mem_pstab[ps]; off += PAGESIZE) {
+        mm_pmem_ref(base + off);
+    }
+
+    return pte;
+}
+
+int
+mu_pmap_clone(struct pmap_gather *pg, struct mu_vas *dst, uintptr_t va,
+    size_t len, bool cow)
+{
+    uintptr_t *src_tbl = NULL, *dst_tbl = NULL;
+    uint64_t *leaf, *huge_tbl;
+    uintptr_t end, next;
+    pagesize_t ps;
+    size_t index;
+    uint64_t pte;
+
+    if (pg == NULL || pg->vas == NULL || dst == NULL) {
+        return -1;
+    }
+
+    va = ALIGN_DOWN(va, PAGESIZE);
+    end = va + ALIGN_UP(len, PAGESIZE);
+    for (; va < end; va += PAGESIZE) {
+        index = vma_level_index(va, PMAP_PML1);
+
+        /* Only walk down again when we cross a table */
+        if (src_tbl == NULL || index == 0) {
+            src_tbl = vma_level_base(pg->vas, va, PMAP_PML1, false);
+            dst_tbl = NULL;
+        }
+
+        /*
+         * No table here, either nothing is mapped or a huge
+         * page is. Either way skip to the next table.
+         */
+        if (src_tbl == NULL) {
+            leaf = pmap_leaf(pg->vas, va, &ps);
+            if (leaf != NULL && ps == PAGESIZE_2M && ISSET(*leaf, PTE_US)) {
+                huge_tbl = vma_level_base(dst, va, PMAP_PML2, true);
+                if (huge_tbl == NULL) {
+                    return -1;
+                }
+
+                pte = pmap_share_leaf(pg, va, *leaf, ps, cow);
+                *leaf = pte;
+                huge_tbl[vma_level_index(va, PMAP_PML2)] = pte;
+            }
+
+            next = ALIGN_UP(va + 1, mem_pstab[PAGESIZE_2M]);
+            if (next >= end) {
+                break;
+            }
+
+            va = next - PAGESIZE;
+            continue;
+        }
+
+        pte = src_tbl[index];
+        if (!ISSET(pte, PTE_P) || !ISSET(pte, PTE_US)) {
+            continue;
+        }
+
+        if (dst_tbl == NULL) {
+            dst_tbl = vma_level_base(dst, va, PMAP_PML1, true);
+            if (dst_tbl == NULL) {
+                return -1;
+            }
+        }
+
+        pte = pmap_share_leaf(pg, va, pte, PAGESIZE_4K, cow);
+        src_tbl[index] = pte;
+        dst_tbl[index] = pte;
+    }
+
+    return 0;
+}
+
+int
+mu_pmap_translate(struct mu_vas *vas, uintptr_t va, uintptr_t *pa, int *prot,
+    pagesize_t *ps)
+{
+    uint64_t *leaf, pte;
+    pagesize_t size;
+    size_t mask;
+
+    if (vas == NULL) {
+        return -1;
+    }
+
+    if ((leaf = pmap_leaf(vas, va, &size)) == NULL) {
+        return -1;
+    }
+
+    pte = *leaf;
+    mask = mem_pstab[size] - 1;
+    if (size != PAGESIZE_4K) {
+        pte = pte_from_huge(pte);
+    }
+
+    if (pa != NULL)
+        *pa = (pte & PTE_ADDR_MASK & ~mask) | (va & mask);
+    if (prot != NULL)
+        *prot = pte_to_prot(pte);
+    if (ps != NULL)
+        *ps = size;
+
+    return 0;
+}
+
+size_t
+mu_pmap_translate_range(struct mu_vas *vas, uintptr_t va, size_t npages,
+    uintptr_t *pa)
+{
+    uint64_t *leaf = NULL, pte = 0;
+    uintptr_t span_end = 0;
+    pagesize_t size = PAGESIZE_4K;
+    size_t i, mask = 0;
+
+    if (vas == NULL || pa == NULL) {
+        return 0;
+    }
+
+    va = ALIGN_DOWN(va, PAGESIZE);
+    for (i = 0; i < npages; ++i, va += PAGESIZE) {
+        /*
+         * Only walk again once we leave the page or leaf
+         * table we found last, neighbours are a step away.
+         */
+        if (leaf != NULL && va < span_end) {
+            if (size == PAGESIZE_4K) {
+                ++leaf;
+                if (!ISSET(*leaf, PTE_P))
+                    break;
+                pte = *leaf;
+            }
+
+            pa[i] = (pte & PTE_ADDR_MASK & ~mask) | (va & mask);
+            continue;
+        }
+
+        if ((leaf = pmap_leaf(vas, va, &size)) == NULL) {
+            break;
+        }
+
+        pte = *leaf;
+        mask = mem_pstab[size] - 1;
+        if (size != PAGESIZE_4K) {
+            pte = pte_from_huge(pte);
+            span_end = ALIGN_DOWN(va, mem_pstab[size]) + mem_pstab[size];
+        } else {
+            span_end = ALIGN_DOWN(va, UNIT_MIB * 2) + (UNIT_MIB * 2);
+        }
+
+        pa[i] = (pte & PTE_ADDR_MASK & ~mask) | (va & mask);
+    }
+
+    return i;
+}
+
+int
+mu_pmap_map(struct mu_vas *vas, uintptr_t vma, uintptr_t pma, int prot,
+    pagesize_t ps)
+{
+    struct pmap_gather pg;
+    int error;
+
+    if (vas == NULL) {
+        return -1;
+    }
+
+    mu_pmap_gather_init(&pg, vas);
+    error = mu_pmap_enter(&pg, vma, pma, prot, ps);
+    mu_pmap_gather_flush(&pg);
+    return error;
+}
+
+int
+mu_pmap_unmap(struct mu_vas *vas, uintptr_t vma, pagesize_t ps)
+{
+    struct pmap_gather pg;
+    int error;
+
+    if (vas == NULL) {
+        return -1;
+    }
+
+    mu_pmap_gather_init(&pg, vas);
+    error = mu_pmap_remove(&pg, vma, ps);
+    mu_pmap_gather_flush(&pg);
+    return error;
+}
+
+/*
+ * Free every paging structure referenced by a range of
+ * entries within a table at a specific level, leaf
+ * frames are left alone.
+ */
+static void
+pmap_free_level(uintptr_t *tbl, pmap_level_t lvl, size_t start, size_t end)
+{
+    uintptr_t phys;
+
+    if (lvl == PMAP_PML1) {
+        return;
+    }
+
+    for (size_t i = start; i < end; ++i) {
+        if (!ISSET(tbl[i], PTE_P) || ISSET(tbl[i], PTE_PS)) {
+            continue;
+        }
+
+        phys = tbl[i] & PTE_ADDR_MASK;
+        pmap_free_level(PHYS_TO_VIRT(phys), lvl - 1, 0, PMAP_NENTRIES);
+        mm_pmem_free(phys, 1);
+        tbl[i] = 0;
+    }
+}
+
+/*
+ * Mark every leaf referenced by a range of entries within
+ * a table at a specific level as global.
+ */
+static void
+pmap_global_level(uintptr_t *tbl, pmap_level_t lvl, size_t start, size_t end)
+{
+    uintptr_t phys;
+
+    for (size_t i = start; i < end; ++i) {
+        if (!ISSET(tbl[i], PTE_P)) {
+            continue;
+        }
+
+        if (lvl == PMAP_PML1 || ISSET(tbl[i], PTE_PS)) {
+            tbl[i] |= PTE_GLOBAL;
+            continue;
+        }
+
+        phys = tbl[i] & PTE_ADDR_MASK;
+        pmap_global_level(PHYS_TO_VIRT(phys), lvl - 1, 0, PMAP_NENTRIES);
+    }
+}
+
+int
+mu_pmap_newvas(struct mu_vas *res)
+{
+    uintptr_t *dest, *src, phys;
+
+    if (res == NULL) {
+        return -1;
+    }
+
+    if ((phys = mm_pmem_alloc(1)) == 0) {
+        return -1;
+    }
+
+    /*
+     * The kernel half only ever references the shared tables
+     * set up by mu_pmap_init() so we can simply copy the
+     * top-level entries and never have to sync them again.
+     */
+    dest = PHYS_TO_VIRT(phys);
+    src = PHYS_TO_VIRT(kvas.cr3 & PTE_ADDR_MASK);
+    memset(dest, 0, PMAP_KERN_START * sizeof(*dest));
+    memcpy(
+        &dest[PMAP_KERN_START],
+        &src[PMAP_KERN_START],
+        (PMAP_NENTRIES - PMAP_KERN_START) * sizeof(*dest)
+    );
+
+    res->cr3 = phys;
+    res->cpumask = 0;
+    res->map = NULL;
+    pmap_walk_flush(res);
+    return 0;
+}
+
+int
+mu_pmap_destroyvas(struct mu_vas *vas)
+{
+    uintptr_t *toplevel, phys;
+
+    if (vas == NULL) {
+        return -1;
+    }
+
+    /* Never destroy a VAS that is in use */
+    phys = vas->cr3 & PTE_ADDR_MASK;
+    if (vas->cpumask != 0 || phys == (kvas.cr3 & PTE_ADDR_MASK)) {
+        return -1;
+    }
+
+    /* Only the user half is private to us */
+    toplevel = PHYS_TO_VIRT(phys);
+    pmap_walk_flush(vas);
+    pmap_free_level(toplevel, pmap_toplevel(), 0, PMAP_KERN_START);
+    mm_pmem_free(phys, 1);
+    vas->cr3 = 0;
     return 0;
 }
 
 void
 mu_pmap_init(void)
 {
-    struct mu_vas vas;
-    uintptr_t *toplevel;
+    uintptr_t *toplevel, phys;
 
     /* Tear down the lower half */
-    mu_pmap_readvas(&vas);
-    toplevel = PHYS_TO_VIRT((vas.cr3 & PTE_ADDR_MASK));
-    for (int i = 0; i < 256; ++i) {
+    mu_pmap_readvas(&kvas);
+    toplevel = PHYS_TO_VIRT((kvas.cr3 & PTE_ADDR_MASK));
+    for (int i = 0; i < PMAP_KERN_START; ++i) {
         toplevel[i] = 0;
     }
 
+    /*
+     * Pre-allocate every table of the kernel half so that
+     * all address spaces can share them.
+     */
+    for (int i = PMAP_KERN_START; i < PMAP_NENTRIES; ++i) {
+        if (ISSET(toplevel[i], PTE_P)) {
+            continue;
+        }
+
+        if ((phys = mm_pmem_alloc(1)) == 0) {
+            panic("pmap: could not allocate kernel tables\n");
+        }
+
+        memset(PHYS_TO_VIRT(phys), 0, PAGESIZE);
+        toplevel[i] = phys | (PTE_P | PTE_RW);
+    }
+
+    /*
+     * The kernel half is the same in every address space,
+     * make what the loader mapped global and enable global
+     * pages so none of it is lost across CR3 loads.
+     */
+    pmap_global_level(
+        toplevel,
+        pmap_toplevel(),
+        PMAP_KERN_START,
+        PMAP_NENTRIES
+    );
+    pmap_write_cr4(pmap_read_cr4() | CR4_PGE);
+    pmap_init_pat();
+
     /* Flush the entire TLB */
-    mu_pmap_writevas(&vas);
+    pmap_flush_tlb_global();
+    mu_pmap_writevas(&kvas);
 }
@@ -29,15 +29,93 @@
 
 #include <sys/types.h>
 #include <sys/cdefs.h>
+#include <sys/param.h>
 #include <core/panic.h>
+#include <core/syscall.h>
+#include <mm/vmem.h>
+#include <mu/cpu.h>
 #include <md/frame.h>
 
-/* Forward declaration */
+#define TRAP_PAGEFLT 0x0E
+
+/*
+ * Page fault error code bits
+ *
+ * See Intel SDM Vol 3A, Section 4.7
+ */
+#define PFEC_P  BIT(0)      /* Protection violation */
+#define PFEC_W  BIT(1)      /* Caused by a write */
+#define PFEC_U  BIT(2)      /* Caused in user mode */
+#define PFEC_I  BIT(4)      /* Caused by an instruction fetch */
+
+/* Forward declarations */
 void trap_dispatch(struct trapframe *tf);
+void syscall_dispatch(struct trapframe *tf);
+
+/*
+ * Attempt to resolve a page fault within the
+ * current virtual address space.
+ *
+ * Returns zero if resolved
+ */
+static int
+trap_pagefault(struct trapframe *tf, uintptr_t cr2)
+{
+    struct pcr *self;
+    int fault = 0;
+
+    if (ISSET(tf->error_code, PFEC_P))
+        fault |= VMEM_FAULT_PROT;
+    if (ISSET(tf->error_code, PFEC_W))
+        fault |= VMEM_FAULT_WRITE;
+    if (ISSET(tf->error_code, PFEC_U))
+        fault |= VMEM_FAULT_USER;
+    if (ISSET(tf->error_code, PFEC_I))
+        fault |= VMEM_FAULT_EXEC;
 
+    self = mu_cpu_self();
+    if (self == NULL || self->curvas == NULL) {
+        return -1;
+    }
+
+    return vmem_fault(self->curvas, cr2, fault);
+}
 
 void
 trap_dispatch(struct trapframe *tf)
 {
+    uintptr_t cr2;
+
+    switch (tf->vector) {
+    case TRAP_PAGEFLT:
+        ASMV(
+            "mov %%cr2, %0"
+            : "=r" (cr2)
+            :
+            : "memory"
+        );
+
+        if (trap_pagefault(tf, cr2) == 0) {
+            return;
+        }
+
+        panic("page fault at %p (ip=%p, error=%x)\n",
+            cr2, tf->rip, tf->error_code);
+    }
+
     panic("fatal vector %x\n", tf->vector);
 }
+
+void
+syscall_dispatch(struct trapframe *tf)
+{
+    struct syscall_args args;
+
+    args.arg[0] = tf->rdi;
+    args.arg[1] = tf->rsi;
+    args.arg[2] = tf->rdx;
+    args.arg[3] = tf->r10;
+    args.arg[4] = tf->r8;
+    args.arg[5] = tf->r9;
+    tf->rax = syscall_handle(tf->rax, &args);
+}
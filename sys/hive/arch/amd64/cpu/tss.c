@@ -34,6 +34,17 @@
 #include <lib/string.h>
 #include <os/pool.h>
 
+void
+md_tss_rsp0(struct tss_entry *tss, uintptr_t rsp0)
+{
+    if (tss == NULL) {
+        return;
+    }
+
+    tss->rsp0_low = rsp0 & 0xFFFFFFFF;
+    tss->rsp0_high = (rsp0 >> 32) & 0xFFFFFFFF;
+}
+
 int
 md_tss_init(struct tss_entry *tss, struct tss_desc *desc)
 {
@@ -45,4 +45,5 @@ mu_timer_init(void)
     }
 
     tsc_init(tmr_dir);
+    ob_knode_unref(tmr_dir);
 }
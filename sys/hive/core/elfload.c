@@ -32,12 +32,81 @@
 #include <sys/errno.h>
 #include <sys/elf.h>
 #include <sys/types.h>
+#include <sys/atomic.h>
+#include <sys/queue.h>
 #include <mm/memvar.h>
 #include <mm/vmem.h>
 #include <mm/pmem.h>
 #include <lib/stdbool.h>
 #include <lib/string.h>
 #include <core/elfload.h>
+#include <core/initrd.h>
+#include <core/spinlock.h>
+#include <core/trace.h>
+#include <os/pool.h>
+
+#define dtrace(fmt, ...) printf("elfload: " fmt, ##__VA_ARGS__)
+
+/* Pages populated after a faulting one of a lazy segment */
+#define ELF_PREFETCH 8
+
+/* Longest initrd path an image may be cached under */
+#define ELF_PATH_MAX 128
+
+/*
+ * Describes a loadable segment of an image, it is the
+ * object backing every region the segment is mapped at.
+ * Frames of read-only segments are kept once loaded so
+ * that every address space mapping the segment shares
+ * them, writable segments hand out a private copy of
+ * each page instead.
+ *
+ * @eh: Image the segment belongs to
+ * @phdr: Program header of the segment
+ * @base: Page aligned virtual base of the segment
+ * @npages: Number of pages spanned by the segment
+ * @prot: Protection the segment is mapped with
+ * @direct: Whole pages of file data may be mapped from the image
+ * @frames: Loaded frames (read-only segments only)
+ * @lock: Protects 'frames'
+ * @refs: Image reference plus one per region
+ * @nloaded: Number of pages loaded so far
+ */
+struct elf_segment {
+    Elf64_Ehdr *eh;
+    Elf64_Phdr phdr;
+    uintptr_t base;
+    size_t npages;
+    int prot;
+    bool direct;
+    uintptr_t *frames;
+    spinlock_t lock;
+    volatile unsigned int refs;
+    volatile unsigned long nloaded;
+};
+
+/*
+ * Describes the parsed layout of an image, images loaded
+ * by path are cached so that later loads only need to map
+ * their segments.
+ *
+ * @path: Path the image was loaded from, empty if uncached
+ * @eh: ELF header of the image
+ * @segs: Loadable segments of the image
+ * @nsegs: Number of loadable segments
+ * @link: Image cache link
+ */
+struct elf_image {
+    char path[ELF_PATH_MAX];
+    Elf64_Ehdr *eh;
+    struct elf_segment **segs;
+    size_t nsegs;
+    TAILQ_ENTRY(elf_image) link;
+};
+
+static TAILQ_HEAD(, elf_image) image_cache =
+    TAILQ_HEAD_INITIALIZER(image_cache);
+static spinlock_t image_cache_lock;
 
 /*
  * Verify that an ELF file to be loaded is valid
@@ -68,23 +137,210 @@ elf_verify(const Elf64_Ehdr *eh)
     return true;
 }
 
+/*
+ * Load a single page of a segment into a frame. Pages
+ * entirely covered by file data are handed out straight
+ * from the image when the segment allows it, the rest
+ * are copied into a fresh zeroed frame.
+ *
+ * Returns zero on success
+ */
 static int
-elf_load(struct mu_vas *vas, Elf64_Ehdr *eh, struct loaded_elf *res)
+elf_seg_page(struct elf_segment *seg, uintptr_t va, uintptr_t *res)
 {
-    struct vmem_region region;
-    Elf64_Phdr *phdr_base, *phdr;
-    void *dest, *src;
+    Elf64_Phdr *phdr = &seg->phdr;
+    uintptr_t file_start, file_end, start, end, pa;
+    void *src;
+
+    file_start = phdr->p_vaddr;
+    file_end = phdr->p_vaddr + phdr->p_filesz;
+
+    /* Clamp to the file backed part of this page */
+    start = (va > file_start) ? va : file_start;
+    end = (va + PAGESIZE < file_end) ? va + PAGESIZE : file_end;
+
+    src = PTR_OFFSET(seg->eh, phdr->p_offset + (start - file_start));
+    if (seg->direct && start == va && end == va + PAGESIZE) {
+        pa = VIRT_TO_PHYS(src);
+        mm_pmem_ref(pa);
+        *res = pa;
+        return 0;
+    }
+
+    if ((pa = mm_pmem_alloc(1)) == 0) {
+        return -ENOMEM;
+    }
+
+    memset(PHYS_TO_VIRT(pa), 0, PAGESIZE);
+    if (start < end) {
+        memcpy(PTR_OFFSET(PHYS_TO_VIRT(pa), start - va), src, end - start);
+    }
+
+    *res = pa;
+    return 0;
+}
+
+static int
+elf_pager_getpage(void *obj, size_t off, uintptr_t *res)
+{
+    struct elf_segment *seg = obj;
+    size_t idx = off / PAGESIZE;
+    int error = 0;
+
+    if (idx >= seg->npages) {
+        return -EFAULT;
+    }
+
+    if (seg->frames == NULL) {
+        atomic_inc_long(&seg->nloaded);
+        return elf_seg_page(seg, seg->base + off, res);
+    }
+
+    /* Load shared pages once, every mapping takes a reference */
+    spinlock_acquire(&seg->lock, true);
+    if (seg->frames[idx] == 0) {
+        error = elf_seg_page(seg, seg->base + off, &seg->frames[idx]);
+        if (error == 0)
+            atomic_inc_long(&seg->nloaded);
+    }
+
+    if (error == 0) {
+        mm_pmem_ref(seg->frames[idx]);
+        *res = seg->frames[idx];
+    }
+
+    spinlock_release(&seg->lock);
+    return error;
+}
+
+static void
+elf_pager_ref(void *obj)
+{
+    struct elf_segment *seg = obj;
+
+    atomic_inc_int(&seg->refs);
+}
+
+static void
+elf_pager_unref(void *obj)
+{
+    struct elf_segment *seg = obj;
+
+    if (atomic_dec_int(&seg->refs) != 0) {
+        return;
+    }
+
+    dtrace("segment at %p released, %d/%d pages loaded\n",
+        seg->base, seg->nloaded, seg->npages);
+
+    if (seg->frames != NULL) {
+        for (size_t i = 0; i < seg->npages; ++i) {
+            if (seg->frames[i] != 0)
+                mm_pmem_unref(seg->frames[i]);
+        }
+
+        os_pool_free(seg->frames);
+    }
+
+    os_pool_free(seg);
+}
+
+static const struct vmem_pager elf_pager = {
+    .getpage = elf_pager_getpage,
+    .ref = elf_pager_ref,
+    .unref = elf_pager_unref,
+    .prefetch = ELF_PREFETCH
+};
+
+/*
+ * Drop an image along with its references on its
+ * segments.
+ */
+static void
+elf_image_free(struct elf_image *img)
+{
+    for (size_t i = 0; i < img->nsegs; ++i) {
+        elf_pager_unref(img->segs[i]);
+    }
+
+    if (img->segs != NULL) {
+        os_pool_free(img->segs);
+    }
+
+    os_pool_free(img);
+}
+
+/*
+ * Create a segment descriptor for a loadable program
+ * header.
+ */
+static struct elf_segment *
+elf_segment_new(Elf64_Ehdr *eh, Elf64_Phdr *phdr)
+{
+    struct elf_segment *seg;
+    uintptr_t src;
     off_t misalign;
-    uintptr_t pma_base;
-    int error;
-    int prot, retval = 0;
+    size_t frames_len;
 
-    if (vas == NULL || eh == NULL) {
-        return -EINVAL;
+    if ((seg = os_pool_allocate(sizeof(*seg))) == NULL) {
+        return NULL;
     }
 
-    if (res == NULL) {
-        return -EINVAL;
+    /* Set the appropriate protection flags */
+    seg->prot = PROT_READ | PROT_USER;
+    if (ISSET(phdr->p_flags, PF_W))
+        seg->prot |= PROT_WRITE;
+    if (ISSET(phdr->p_flags, PF_X))
+        seg->prot |= PROT_EXEC;
+
+    /*
+     * Read-only pages can be shared with the image itself
+     * as long as the file data sits at the same offset
+     * within a page as it does in memory.
+     */
+    misalign = phdr->p_vaddr & (PAGESIZE - 1);
+    src = (uintptr_t)PTR_OFFSET(eh, phdr->p_offset);
+
+    seg->eh = eh;
+    seg->phdr = *phdr;
+    seg->base = ALIGN_DOWN(phdr->p_vaddr, PAGESIZE);
+    seg->npages = ALIGN_UP(phdr->p_memsz + misalign, PAGESIZE) / PAGESIZE;
+    seg->direct = !ISSET(seg->prot, PROT_WRITE) &&
+        (src & (PAGESIZE - 1)) == (uintptr_t)misalign;
+    seg->frames = NULL;
+    seg->lock = 0;
+    seg->refs = 1;
+    seg->nloaded = 0;
+
+    if (ISSET(seg->prot, PROT_WRITE)) {
+        return seg;
+    }
+
+    frames_len = seg->npages * sizeof(*seg->frames);
+    if ((seg->frames = os_pool_allocate(frames_len)) == NULL) {
+        os_pool_free(seg);
+        return NULL;
+    }
+
+    memset(seg->frames, 0, frames_len);
+    return seg;
+}
+
+/*
+ * Parse the loadable segments of an image
+ *
+ * Returns zero on success
+ */
+static int
+elf_image_new(Elf64_Ehdr *eh, struct elf_image **res)
+{
+    struct elf_image *img;
+    Elf64_Phdr *phdr_base, *phdr;
+    size_t nsegs = 0;
+
+    /* Ensure that the image is valid */
+    if (!elf_verify(eh)) {
+        return -ENOEXEC;
     }
 
     phdr_base = PTR_OFFSET(eh, eh->e_phoff);
@@ -93,59 +349,166 @@ elf_load(struct mu_vas *vas, Elf64_Ehdr *eh, struct loaded_elf *res)
 
     for (int i = 0; i < eh->e_phnum; ++i) {
         phdr = PHDR_INDEX(i);
+        if (phdr->p_type == PT_LOAD && phdr->p_memsz != 0)
+            ++nsegs;
+        if (phdr->p_filesz > phdr->p_memsz)
+            return -ENOEXEC;
+    }
+
+    /* Nothing to load */
+    if (nsegs == 0) {
+        return -ENOEXEC;
+    }
 
-        /* Drop non-loadable sections */
-        if (phdr->p_type != PT_LOAD)
+    if ((img = os_pool_allocate(sizeof(*img))) == NULL) {
+        return -ENOMEM;
+    }
+
+    img->path[0] = '\0';
+    img->eh = eh;
+    img->nsegs = 0;
+    img->segs = os_pool_allocate(nsegs * sizeof(*img->segs));
+    if (img->segs == NULL) {
+        elf_image_free(img);
+        return -ENOMEM;
+    }
+
+    for (int i = 0; i < eh->e_phnum; ++i) {
+        phdr = PHDR_INDEX(i);
+
+        /* Drop non-loadable and empty segments */
+        if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0)
             continue;
 
-        /* Drop empty segments */
-        if (phdr->p_memsz == 0)
+        img->segs[img->nsegs] = elf_segment_new(eh, phdr);
+        if (img->segs[img->nsegs] == NULL) {
+            elf_image_free(img);
+            return -ENOMEM;
+        }
+
+        ++img->nsegs;
+    }
+#undef PHDR_INDEX
+
+    *res = img;
+    return 0;
+}
+
+/*
+ * Populate the pages that follow the entry point so that
+ * a lazily loaded program does not fault its way into
+ * its first instructions.
+ *
+ * Returns the number of pages populated
+ */
+static size_t
+elf_prefault_entry(struct mu_vas *vas, struct elf_image *img)
+{
+    struct elf_segment *seg;
+    uintptr_t entry, va, end;
+
+    entry = img->eh->e_entry;
+    for (size_t i = 0; i < img->nsegs; ++i) {
+        seg = img->segs[i];
+        end = seg->base + (seg->npages * PAGESIZE);
+        if (entry < seg->base || entry >= end)
             continue;
 
-        /* Set the appropriate protection flags */
-        prot = PROT_READ | PROT_USER;
-        if (ISSET(phdr->p_flags, PF_W))
-            prot |= PROT_WRITE;
-        if (ISSET(phdr->p_flags, PF_X))
-            prot |= PROT_EXEC;
-
-        /*
-         * Next, we construct the region descriptor and allocate
-         * the required memory before we begin mapping.
-         */
-        misalign = phdr->p_vaddr & (PAGESIZE - 1);
-        region.length = ALIGN_UP(phdr->p_memsz + misalign, PAGESIZE);
-        region.vma = phdr->p_vaddr;
-        region.pma = mm_pmem_alloc(region.length / PAGESIZE);
-        if (region.pma == 0) {
-            retval = -ENOMEM;
-            break;
+        va = ALIGN_DOWN(entry, PAGESIZE);
+        if (end > va + ((ELF_PREFETCH + 1) * PAGESIZE)) {
+            end = va + ((ELF_PREFETCH + 1) * PAGESIZE);
         }
 
-        /*
-         * Now we map the full range of memory, this will be mapped
-         * into the given virtual address space so we'll need to do
-         * some HHDM magic to copy the data.
-         */
-        error = vmem_map_region(vas, &region, prot);
+        if (vmem_prefault(vas, va, end - va) != 0)
+            return 0;
+
+        return (end - va) / PAGESIZE;
+    }
+
+    return 0;
+}
+
+/*
+ * Map every segment of an image into an address space,
+ * pages are loaded up front unless ELF_LAZY is set. Pages
+ * holding nothing but BSS are always left to be zero-filled
+ * on first touch.
+ */
+static int
+elf_image_map(struct mu_vas *vas, struct elf_image *img, int flags,
+    struct loaded_elf *res)
+{
+    struct elf_segment *seg;
+    uintptr_t va, file_end;
+    size_t length;
+    int error;
+
+    res->npages = 0;
+    res->nloaded = 0;
+    for (size_t i = 0; i < img->nsegs; ++i) {
+        seg = img->segs[i];
+        length = seg->npages * PAGESIZE;
+
+        /* Writable segments must never reach back into the image */
+        error = vmem_mmap_object(
+            vas, seg->base, length,
+            seg->prot, MAP_PRIVATE | MAP_FIXED,
+            &elf_pager, seg, 0, &va
+        );
+
         if (error != 0) {
-            retval = error;
-            break;
+            return error;
         }
 
-        /* Now copy the segment into memory */
-        dest = PHYS_TO_VIRT(region.pma);
-        src = PTR_OFFSET(eh, phdr->p_offset);
-        memcpy(dest, src, phdr->p_memsz);
+        res->npages += seg->npages;
+        if (ISSET(flags, ELF_LAZY)) {
+            continue;
+        }
+
+        file_end = ALIGN_UP(seg->phdr.p_vaddr + seg->phdr.p_filesz, PAGESIZE);
+        if (file_end <= seg->base) {
+            continue;
+        }
+
+        length = file_end - seg->base;
+        if ((error = vmem_prefault(vas, seg->base, length)) != 0) {
+            return error;
+        }
+
+        res->nloaded += length / PAGESIZE;
     }
-#undef PHDR_INDEX
-    return retval;
+
+    if (ISSET(flags, ELF_LAZY | ELF_PREFAULT_ENTRY) ==
+        (ELF_LAZY | ELF_PREFAULT_ENTRY)) {
+        res->nloaded += elf_prefault_entry(vas, img);
+    }
+
+    res->entrypoint = img->eh->e_entry;
+    return 0;
+}
+
+/*
+ * Lookup an image within the image cache, the cache
+ * must be locked.
+ */
+static struct elf_image *
+elf_cache_lookup(const char *path)
+{
+    struct elf_image *img;
+
+    TAILQ_FOREACH(img, &image_cache, link) {
+        if (strcmp(img->path, path) == 0)
+            return img;
+    }
+
+    return NULL;
 }
 
 int
-elf_load_raw(struct mu_vas *vas, void *image, struct loaded_elf *res)
+elf_load_raw(struct mu_vas *vas, void *image, int flags,
+    struct loaded_elf *res)
 {
-    Elf64_Ehdr *eh;
+    struct elf_image *img;
     int error;
 
     if (vas == NULL || image == NULL) {
@@ -156,17 +519,63 @@ elf_load_raw(struct mu_vas *vas, void *image, struct loaded_elf *res)
         return -EINVAL;
     }
 
-    /* Ensure that the image is valid */
-    eh = (Elf64_Ehdr *)image;
-    if (!elf_verify(eh)) {
-        return false;
+    if ((error = elf_image_new(image, &img)) != 0) {
+        return error;
     }
 
-    error = elf_load(vas, eh, res);
-    if (error != 0) {
-        return error;
+    /* Mapped segments keep themselves alive */
+    error = elf_image_map(vas, img, flags, res);
+    elf_image_free(img);
+    return error;
+}
+
+int
+elf_load_path(struct mu_vas *vas, const char *path, int flags,
+    struct loaded_elf *res)
+{
+    struct elf_image *img, *tmp;
+    void *image;
+    int error;
+
+    if (vas == NULL || path == NULL || res == NULL) {
+        return -EINVAL;
     }
 
-    res->entrypoint = eh->e_entry;
-    return 0;
+    /* The initrd has no notion of a leading slash */
+    if (*path == '/') {
+        ++path;
+    }
+
+    if (strlen(path) >= ELF_PATH_MAX) {
+        return -ENAMETOOLONG;
+    }
+
+    spinlock_acquire(&image_cache_lock, true);
+    img = elf_cache_lookup(path);
+    spinlock_release(&image_cache_lock);
+
+    if (img == NULL) {
+        if ((image = initrd_lookup(path)) == NULL) {
+            return -ENOENT;
+        }
+
+        if ((error = elf_image_new(image, &img)) != 0) {
+            return error;
+        }
+
+        /* Someone may have beaten us to it */
+        spinlock_acquire(&image_cache_lock, true);
+        if ((tmp = elf_cache_lookup(path)) == NULL) {
+            memcpy(img->path, path, strlen(path) + 1);
+            TAILQ_INSERT_TAIL(&image_cache, img, link);
+        }
+
+        spinlock_release(&image_cache_lock);
+        if (tmp != NULL) {
+            elf_image_free(img);
+            img = tmp;
+        }
+    }
+
+    return elf_image_map(vas, img, flags, res);
 }
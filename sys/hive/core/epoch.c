@@ -40,53 +40,57 @@
 #include <mu/cpu.h>
 #include <mu/pmap.h>
 #include <mm/pmem.h>
+#include <mm/vmem.h>
+#include <mm/kva.h>
 #include <mm/memvar.h>
 
 #define RTS_PATH "/sbin/rts"
 
+/* User stack of rts, populated on demand */
+#define RTS_STACK_TOP  0x7FFFFFFFF000
+#define RTS_STACK_SIZE 0x40000      /* 256 KiB */
+
 static struct pcr bsp;
+static struct mu_vas rts_vas;
 
 void kmain(void);
 
 NORETURN static void
 start_rts(void)
 {
-    uintptr_t stack;
     struct loaded_elf elf;
-    struct mu_vas vas;
-    void *data;
     int error;
 
-    if (mu_pmap_readvas(&vas) != 0) {
-        panic("hive: unable to read VAS for loading\n");
-    }
-
-    if ((stack = mm_pmem_alloc(1)) == 0) {
-        panic("hive: unable to allocate user stack\n");
+    if (mu_pmap_newvas(&rts_vas) != 0) {
+        panic("hive: unable to create VAS for loading\n");
     }
 
-    error = mu_pmap_map(
-        &vas,
-        stack,
-        stack,
-        PROT_READ | PROT_WRITE | PROT_USER,
-        PAGESIZE_4K
+    error = vmem_reserve(
+        &rts_vas,
+        RTS_STACK_TOP - RTS_STACK_SIZE,
+        RTS_STACK_SIZE,
+        PROT_READ | PROT_WRITE | PROT_USER
     );
 
     if (error != 0) {
-        panic("hive: unable to map stack\n");
+        panic("hive: unable to reserve user stack\n");
     }
 
-    if ((data = initrd_lookup(RTS_PATH)) == NULL) {
-        panic("hive: unable to lookup \"%s\"\n", RTS_PATH);
-    }
+    error = elf_load_path(
+        &rts_vas, RTS_PATH,
+        ELF_LAZY | ELF_PREFAULT_ENTRY,
+        &elf
+    );
 
-    if ((elf_load_raw(&vas, data, &elf)) != 0) {
+    if (error != 0) {
         panic("hive: unable to load \"%s\"\n", RTS_PATH);
     }
 
-    stack += PAGESIZE - 1;
-    mu_proc_uvector(elf.entrypoint, stack);
+    printf("hive: loaded \"%s\" (%d of %d pages up front)\n",
+        RTS_PATH, elf.nloaded, elf.npages);
+
+    mu_pmap_writevas(&rts_vas);
+    mu_proc_uvector(elf.entrypoint, RTS_STACK_TOP);
 }
 
 void
@@ -106,6 +110,9 @@ kmain(void)
     printf("hive: engaging pmap layer...\n");
     mu_pmap_init();
 
+    printf("hive: engaging kva...\n");
+    mm_kva_init();
+
     printf("hive: configuring bsp...\n");
     mu_cpu_conf(&bsp);
 
@@ -30,81 +30,723 @@
 #include <sys/types.h>
 #include <sys/cdefs.h>
 #include <sys/param.h>
+#include <sys/errno.h>
+#include <sys/queue.h>
 #include <core/bpt.h>
+#include <core/initrd.h>
+#include <core/lz4.h>
 #include <core/panic.h>
+#include <core/spinlock.h>
+#include <core/trace.h>
+#include <mm/memvar.h>
+#include <mm/pmem.h>
 #include <lib/string.h>
+#include <lib/stdbool.h>
+#include <ob/knode.h>
+#include <ob/dir.h>
+#include <os/pool.h>
+
+#define dtrace(fmt, ...) printf("initrd: " fmt, ##__VA_ARGS__)
 
 #define INITRD_PATH "/boot/initrd.mr"
 #define MEMAR_MAGIC "LORD"
+#define MEMAR_INDEX_MAGIC "LIDX"
 #define MEMAR_MAGIC_LEN 4
+#define MEMAR_VERSION 4
 #define FILE_NAME_MAX 99
 
+/* Payload codecs */
+#define MEMAR_CODEC_NONE 0
+#define MEMAR_CODEC_LZ4  1
+
+/* Uncompressed length of each block of a compressed file */
+#define MEMAR_BLOCK_SIZE 0x4000
+
+/* Number of decompressed blocks kept around */
+#define INITRD_CACHE_SIZE 8
+
+/* Alignment bounds of a payload as a power of two */
+#define FILE_ALIGN_MIN 3
+#define FILE_ALIGN_MAX 21
+
+/* Directory the initrd is mounted at */
+#define INITRD_MOUNT "initrd"
+
+/* Longest path that may be looked up */
+#define INITRD_PATH_MAX 128
+
 static struct bpt_module initrd;
+static struct knode *initrd_root;
 
 /*
  * Represents a header that sits on top of each file
  * in the archive
  *
- * @hdr_size: Length of the header
+ * @version: Layout version (MEMAR_VERSION)
+ * @align_shift: Payload alignment as a power of two
+ * @codec: Codec the payload is stored with
+ * @hdr_size: Length of the header and its padding
+ * @file_size: Length of the file once decompressed
+ * @data_size: Length of the payload as stored
+ * @data_off: Offset of the payload from the archive base
+ * @hash: FNV-1a hash of the file contents
  * @name: Filename
  *
  * This format is as follows:
  *
+ * < INDEX (optional) >
  * < FILE HEADER   >
+ * < PADDING >
  * < FILE CONTENTS >
  * < PADDING >
  * ...
+ *
+ * Both the payload and its trailing padding are aligned
+ * to 1 << align_shift. Compressed payloads start with a
+ * table of 32-bit block offsets relative to the payload,
+ * one per MEMAR_BLOCK_SIZE bytes of the file plus one that
+ * marks the end of the last block. A block that is as long
+ * as its decompressed length is stored as is.
+ *
+ * Files with the same contents share a single payload that
+ * only follows the first of their headers, the others are
+ * directly followed by the next header.
+ *
+ * XXX: Must be kept in sync with gen/memar
  */
 struct PACKED file_hdr {
     char magic[MEMAR_MAGIC_LEN];
-    size_t hdr_size;
-    size_t file_size;
+    uint8_t version;
+    uint8_t align_shift;
+    uint8_t codec;
+    uint64_t hdr_size;
+    uint64_t file_size;
+    uint64_t data_size;
+    uint64_t data_off;
+    uint64_t hash;
     uint8_t fname_size;
     char name[FILE_NAME_MAX];
 };
 
-void *
-initrd_lookup(const char *path)
+/*
+ * Represents the index block at the head of newer
+ * archives, it is followed by 'nbuckets' buckets forming
+ * an open addressed hash table of file names.
+ *
+ * @magic: Index magic (MEMAR_INDEX_MAGIC)
+ * @version: Layout version (MEMAR_VERSION)
+ * @flags: Archive flags
+ * @nbuckets: Number of buckets, a power of two
+ * @length: Length of the index block
+ */
+struct PACKED memar_index {
+    char magic[MEMAR_MAGIC_LEN];
+    uint16_t version;
+    uint16_t flags;
+    uint32_t nbuckets;
+    uint64_t length;
+};
+
+/*
+ * Represents a bucket within the index
+ *
+ * @hash: FNV-1a hash of the file name
+ * @name_len: Length of the file name
+ * @offset: Offset of the file header, zero if empty
+ */
+struct PACKED memar_bucket {
+    uint32_t hash;
+    uint32_t name_len;
+    uint64_t offset;
+};
+
+/*
+ * Represents a decompressed block of a compressed file
+ *
+ * @hdr: File the block belongs to, NULL if unused
+ * @block: Index of the block within the file
+ * @length: Number of valid bytes in 'data'
+ * @stamp: Last time the block was used
+ * @data: Decompressed contents
+ */
+struct initrd_block {
+    struct file_hdr *hdr;
+    size_t block;
+    size_t length;
+    size_t stamp;
+    void *data;
+};
+
+/*
+ * Represents a compressed file that has been decompressed
+ * as a whole, it is kept for the lifetime of the system.
+ *
+ * @hdr: File that has been decompressed
+ * @data: Page aligned decompressed contents
+ * @link: Inflated file list link
+ */
+struct initrd_inflated {
+    struct file_hdr *hdr;
+    void *data;
+    TAILQ_ENTRY(initrd_inflated) link;
+};
+
+static struct initrd_block block_cache[INITRD_CACHE_SIZE];
+static size_t block_clock = 0;
+static spinlock_t block_lock;
+
+static TAILQ_HEAD(, initrd_inflated) inflated =
+    TAILQ_HEAD_INITIALIZER(inflated);
+static spinlock_t inflate_lock;
+
+/*
+ * Returns the index of the archive or NULL if it
+ * predates them.
+ */
+static struct memar_index *
+initrd_index(void)
+{
+    struct memar_index *index = initrd.address;
+    size_t table_len;
+
+    if (index == NULL || initrd.length < sizeof(*index)) {
+        return NULL;
+    }
+
+    if (memcmp(index->magic, MEMAR_INDEX_MAGIC, MEMAR_MAGIC_LEN) != 0) {
+        return NULL;
+    }
+
+    if (index->version != MEMAR_VERSION) {
+        return NULL;
+    }
+
+    table_len = index->nbuckets * sizeof(struct memar_bucket);
+    if (index->length < sizeof(*index) + table_len) {
+        return NULL;
+    }
+
+    if (index->length > initrd.length) {
+        return NULL;
+    }
+
+    return index;
+}
+
+/*
+ * Returns true if a file header is sane and of a
+ * layout we understand.
+ */
+static inline bool
+initrd_hdr_valid(struct file_hdr *hdr)
+{
+    if (memcmp(hdr->magic, MEMAR_MAGIC, MEMAR_MAGIC_LEN) != 0) {
+        return false;
+    }
+
+    if (hdr->version != MEMAR_VERSION) {
+        return false;
+    }
+
+    if (hdr->codec > MEMAR_CODEC_LZ4) {
+        return false;
+    }
+
+    if (hdr->align_shift < FILE_ALIGN_MIN) {
+        return false;
+    }
+
+    return hdr->align_shift <= FILE_ALIGN_MAX;
+}
+
+/*
+ * Returns true if two files share a payload, 'a' may
+ * be NULL.
+ */
+static inline bool
+initrd_same_payload(struct file_hdr *a, struct file_hdr *b)
+{
+    if (a == NULL) {
+        return false;
+    }
+
+    return a == b || a->data_off == b->data_off;
+}
+
+/*
+ * Decompress a single block of a compressed file
+ *
+ * @hdr: File the block belongs to
+ * @block: Index of the block
+ * @dst: Buffer of at least MEMAR_BLOCK_SIZE bytes
+ *
+ * Returns the length of the block on success, otherwise
+ * a less than zero value on failure.
+ */
+static ssize_t
+initrd_block_inflate(struct file_hdr *hdr, size_t block, void *dst)
+{
+    uint32_t *table;
+    size_t nblocks, raw_len, start, end;
+    ssize_t len;
+    void *src;
+
+    nblocks = ALIGN_UP(hdr->file_size, MEMAR_BLOCK_SIZE) / MEMAR_BLOCK_SIZE;
+    if (block >= nblocks) {
+        return -EINVAL;
+    }
+
+    table = PTR_OFFSET(initrd.address, hdr->data_off);
+    start = table[block];
+    end = table[block + 1];
+    if (start > end || end > hdr->data_size) {
+        return -EINVAL;
+    }
+
+    raw_len = hdr->file_size - (block * MEMAR_BLOCK_SIZE);
+    if (raw_len > MEMAR_BLOCK_SIZE) {
+        raw_len = MEMAR_BLOCK_SIZE;
+    }
+
+    src = PTR_OFFSET(table, start);
+    if (end - start == raw_len) {
+        memcpy(dst, src, raw_len);
+        return raw_len;
+    }
+
+    len = lz4_decompress(src, end - start, dst, raw_len);
+    if (len != (ssize_t)raw_len) {
+        return -EINVAL;
+    }
+
+    return len;
+}
+
+/*
+ * Lookup a decompressed block, decompressing it into the
+ * least recently used slot on a miss. The block cache must
+ * be locked.
+ */
+static struct initrd_block *
+initrd_block_get(struct file_hdr *hdr, size_t block)
+{
+    struct initrd_block *bp, *victim = NULL;
+    ssize_t len;
+
+    for (size_t i = 0; i < INITRD_CACHE_SIZE; ++i) {
+        bp = &block_cache[i];
+        if (initrd_same_payload(bp->hdr, hdr) && bp->block == block) {
+            bp->stamp = ++block_clock;
+            return bp;
+        }
+
+        if (victim == NULL || bp->stamp < victim->stamp) {
+            victim = bp;
+        }
+    }
+
+    if (victim->data == NULL) {
+        victim->data = os_pool_allocate(MEMAR_BLOCK_SIZE);
+        if (victim->data == NULL)
+            return NULL;
+    }
+
+    victim->hdr = NULL;
+    if ((len = initrd_block_inflate(hdr, block, victim->data)) < 0) {
+        return NULL;
+    }
+
+    victim->hdr = hdr;
+    victim->block = block;
+    victim->length = len;
+    victim->stamp = ++block_clock;
+    return victim;
+}
+
+/*
+ * Decompress a whole file into frames of its own, later
+ * calls return the same copy.
+ */
+static void *
+initrd_inflate(struct file_hdr *hdr)
+{
+    struct initrd_inflated *ip, *tmp;
+    size_t nblocks, npages;
+    uintptr_t pa;
+    void *data;
+
+    spinlock_acquire(&inflate_lock, true);
+    TAILQ_FOREACH(ip, &inflated, link) {
+        if (initrd_same_payload(ip->hdr, hdr))
+            break;
+    }
+
+    spinlock_release(&inflate_lock);
+    if (ip != NULL) {
+        return ip->data;
+    }
+
+    /* Decompress straight into the frames */
+    npages = ALIGN_UP(hdr->file_size, PAGESIZE) / PAGESIZE;
+    nblocks = ALIGN_UP(hdr->file_size, MEMAR_BLOCK_SIZE) / MEMAR_BLOCK_SIZE;
+    if (npages == 0 || (pa = mm_pmem_alloc(npages)) == 0) {
+        return NULL;
+    }
+
+    data = PHYS_TO_VIRT(pa);
+    memset(PTR_OFFSET(data, hdr->file_size), 0,
+        (npages * PAGESIZE) - hdr->file_size);
+
+    /* Blocks are multiples of the page size, the last one fits */
+    for (size_t i = 0; i < nblocks; ++i) {
+        if (initrd_block_inflate(hdr, i,
+            PTR_OFFSET(data, i * MEMAR_BLOCK_SIZE)) < 0) {
+            mm_pmem_free(pa, npages);
+            return NULL;
+        }
+    }
+
+    if ((ip = os_pool_allocate(sizeof(*ip))) == NULL) {
+        mm_pmem_free(pa, npages);
+        return NULL;
+    }
+
+    ip->hdr = hdr;
+    ip->data = data;
+
+    /* Someone may have beaten us to it */
+    spinlock_acquire(&inflate_lock, true);
+    TAILQ_FOREACH(tmp, &inflated, link) {
+        if (initrd_same_payload(tmp->hdr, hdr))
+            break;
+    }
+
+    if (tmp == NULL) {
+        TAILQ_INSERT_TAIL(&inflated, ip, link);
+    }
+
+    spinlock_release(&inflate_lock);
+    if (tmp != NULL) {
+        os_pool_free(ip);
+        mm_pmem_free(pa, npages);
+        return tmp->data;
+    }
+
+    /* Like the archive itself, these may be mapped directly */
+    mm_pmem_pin(pa, npages);
+    dtrace("inflated %d -> %d bytes\n", hdr->data_size, hdr->file_size);
+    return data;
+}
+
+/*
+ * Describe the payload of a file
+ */
+static void
+initrd_hdr_extent(struct file_hdr *hdr, struct initrd_extent *res)
+{
+    size_t align;
+
+    res->file = hdr;
+    res->length = hdr->file_size;
+    res->compressed = hdr->codec != MEMAR_CODEC_NONE;
+    if (res->compressed) {
+        res->data = NULL;
+        res->pa = 0;
+        res->mappable = false;
+        return;
+    }
+
+    res->data = PTR_OFFSET(initrd.address, hdr->data_off);
+    res->pa = VIRT_TO_PHYS(res->data);
+
+    /*
+     * Only hand out the frames directly if the payload
+     * owns every page it touches, the module itself may
+     * have been loaded at any byte boundary.
+     */
+    align = BIT(hdr->align_shift);
+    res->mappable = align >= PAGESIZE &&
+        (res->pa & (PAGESIZE - 1)) == 0;
+}
+
+/*
+ * Create the knode of a file along with every directory
+ * leading up to it.
+ */
+static int
+initrd_mount_file(struct file_hdr *hdr)
+{
+    struct knode *dir = initrd_root, *knp;
+    struct initrd_extent *extent;
+    char name[KNODE_NAME_LEN];
+    const char *p, *p_end;
+    size_t len;
+    int error;
+
+    p = hdr->name;
+    p_end = p + hdr->fname_size;
+    while (p < p_end) {
+        len = 0;
+        while (p + len < p_end && p[len] != '/') {
+            ++len;
+        }
+
+        /* Skip empty components */
+        if (len == 0) {
+            ++p;
+            continue;
+        }
+
+        if (len >= KNODE_NAME_LEN - 1) {
+            return -ENAMETOOLONG;
+        }
+
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len;
+
+        error = ob_dir_lookup(dir, name, &knp);
+        if (p < p_end) {
+            if (error == -ENOENT) {
+                if ((error = ob_dir_new(name, &knp)) != 0)
+                    return error;
+
+                /* Only taken over on success */
+                if ((error = ob_dir_append(knp, dir)) != 0) {
+                    ob_knode_unref(knp);
+                    return error;
+                }
+            }
+
+            if (error != 0)
+                return error;
+            if (knp->type != K_DIR)
+                return -ENOTDIR;
+
+            dir = knp;
+            continue;
+        }
+
+        if (error != -ENOENT) {
+            return (error == 0) ? -EEXIST : error;
+        }
+
+        if ((extent = os_pool_allocate(sizeof(*extent))) == NULL) {
+            return -ENOMEM;
+        }
+
+        if ((error = ob_knode_new(name, K_FILE, &knp)) != 0) {
+            os_pool_free(extent);
+            return error;
+        }
+
+        initrd_hdr_extent(hdr, extent);
+        knp->data = extent;
+        if ((error = ob_dir_append(knp, dir)) != 0) {
+            os_pool_free(extent);
+            ob_knode_unref(knp);
+            return error;
+        }
+
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+/*
+ * Walk the archive once and build a knode tree of
+ * every file within it.
+ */
+static void
+initrd_mount(void)
 {
+    struct memar_index *index;
     struct file_hdr *hdr;
     char *p, *p_end;
+    size_t align, off, nfiles = 0;
+    int error;
 
-    if (path == NULL) {
-        return NULL;
+    if ((error = ob_dir_new(INITRD_MOUNT, &initrd_root)) != 0) {
+        panic("initrd: could not create /%s\n", INITRD_MOUNT);
+    }
+
+    if ((error = ob_dir_append(initrd_root, NULL)) != 0) {
+        panic("initrd: could not mount /%s\n", INITRD_MOUNT);
+    }
+
+    p = initrd.address;
+    p_end = PTR_OFFSET(initrd.address, initrd.length);
+    if ((index = initrd_index()) != NULL) {
+        p = PTR_OFFSET(p, index->length);
+    }
+
+    /* Headers only hold as much of the name as they need */
+    while (p + (sizeof(*hdr) - FILE_NAME_MAX) <= p_end) {
+        hdr = (struct file_hdr *)p;
+        if (!initrd_hdr_valid(hdr)) {
+            break;
+        }
+
+        if (hdr->hdr_size < sizeof(*hdr) - FILE_NAME_MAX + hdr->fname_size) {
+            dtrace("bad header at %p\n", hdr);
+            break;
+        }
+
+        /* Only the first file sharing a payload is followed by it */
+        align = BIT(hdr->align_shift);
+        p = PTR_OFFSET(hdr, hdr->hdr_size);
+        off = (uintptr_t)p - (uintptr_t)initrd.address;
+        if (hdr->data_off == off) {
+            p = PTR_OFFSET(p, ALIGN_UP(hdr->data_size, align));
+        }
+
+        if (p > p_end) {
+            dtrace("truncated archive\n");
+            break;
+        }
+
+        if (hdr->data_off + hdr->data_size > initrd.length) {
+            dtrace("payload of file at %p out of bounds\n", hdr);
+            continue;
+        }
+
+        if ((error = initrd_mount_file(hdr)) != 0) {
+            dtrace("could not mount file at %p (error=%d)\n", hdr, error);
+            continue;
+        }
+
+        ++nfiles;
+    }
+
+    dtrace("mounted %d files at /%s\n", nfiles, INITRD_MOUNT);
+}
+
+int
+initrd_lookup_extent(const char *path, struct initrd_extent *res)
+{
+    struct knode *knp;
+    char pathbuf[INITRD_PATH_MAX];
+    size_t len, prefix_len;
+    int error;
+
+    if (path == NULL || res == NULL) {
+        return -EINVAL;
     }
 
     if (*path == '/') {
         ++path;
     }
 
-    if ((p = initrd.address) == NULL) {
+    if (initrd_root == NULL) {
+        return -ENOENT;
+    }
+
+    /* Resolve it relative to the mount point */
+    len = strlen(path);
+    prefix_len = sizeof(INITRD_MOUNT);
+    if (prefix_len + len >= sizeof(pathbuf)) {
+        return -ENAMETOOLONG;
+    }
+
+    memcpy(pathbuf, INITRD_MOUNT "/", prefix_len);
+    memcpy(&pathbuf[prefix_len], path, len + 1);
+    if ((error = ob_knode_resolve(pathbuf, 0, &knp)) != 0) {
+        return error;
+    }
+
+    /* Initrd files are never removed, a copy will do */
+    if (knp->type != K_FILE) {
+        ob_knode_unref(knp);
+        return -EISDIR;
+    }
+
+    *res = *(struct initrd_extent *)knp->data;
+    ob_knode_unref(knp);
+    return 0;
+}
+
+void *
+initrd_lookup(const char *path)
+{
+    struct initrd_extent extent;
+
+    if (initrd_lookup_extent(path, &extent) != 0) {
         return NULL;
     }
 
-    p_end = PTR_OFFSET(p, initrd.length);
-    while (p < p_end) {
-        hdr = (struct file_hdr *)p;
-        if (memcmp(hdr->magic, MEMAR_MAGIC, MEMAR_MAGIC_LEN) != 0) {
-            return NULL;
+    if (extent.compressed) {
+        return initrd_inflate(extent.file);
+    }
+
+    return extent.data;
+}
+
+ssize_t
+initrd_read(const struct initrd_extent *extent, size_t off, void *buf,
+    size_t len)
+{
+    struct initrd_block *bp;
+    size_t block, block_off, count, done = 0;
+
+    if (extent == NULL || buf == NULL) {
+        return -EINVAL;
+    }
+
+    if (off >= extent->length) {
+        return 0;
+    }
+
+    if (len > extent->length - off) {
+        len = extent->length - off;
+    }
+
+    if (!extent->compressed) {
+        memcpy(buf, PTR_OFFSET(extent->data, off), len);
+        return len;
+    }
+
+    /* Only the blocks being read are decompressed */
+    spinlock_acquire(&block_lock, true);
+    while (done < len) {
+        block = (off + done) / MEMAR_BLOCK_SIZE;
+        block_off = (off + done) % MEMAR_BLOCK_SIZE;
+        if ((bp = initrd_block_get(extent->file, block)) == NULL) {
+            spinlock_release(&block_lock);
+            return -EIO;
         }
 
-        if (memcmp(hdr->name, path, hdr->fname_size) == 0) {
-            return PTR_OFFSET(hdr, hdr->hdr_size);
+        count = bp->length - block_off;
+        if (count > len - done) {
+            count = len - done;
         }
 
-        p = PTR_OFFSET(hdr, hdr->file_size + hdr->hdr_size);
+        memcpy(PTR_OFFSET(buf, done), PTR_OFFSET(bp->data, block_off), count);
+        done += count;
     }
 
-    return NULL;
+    spinlock_release(&block_lock);
+    return done;
 }
 
 void
 initrd_init(void)
 {
+
+    uintptr_t base, end;
     int error;
 
     error = bpt_get_module(INITRD_PATH, &initrd);
     if (error != 0) {
         panic("initrd: could not find \"%s\"\n", INITRD_PATH);
     }
+
+    /*
+     * Programs may map pages of the image straight into
+     * their address spaces, they must stay put.
+     */
+    base = ALIGN_DOWN(VIRT_TO_PHYS(initrd.address), PAGESIZE);
+    end = ALIGN_UP(VIRT_TO_PHYS(initrd.address) + initrd.length, PAGESIZE);
+    mm_pmem_pin(base, (end - base) / PAGESIZE);
+    initrd_mount();
 }
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2025 Ian Marco Moffett and the OpenModality engineers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <core/lz4.h>
+
+/* Shortest match that may be encoded */
+#define LZ4_MINMATCH 4
+
+/* Length nibble that denotes trailing length bytes */
+#define LZ4_RUN_MASK 0x0F
+
+/*
+ * Read a run length, lengths at or above 'LZ4_RUN_MASK'
+ * continue in the bytes that follow the token.
+ *
+ * Returns zero on success
+ */
+static int
+lz4_length(const uint8_t **ip, const uint8_t *ip_end, size_t *len)
+{
+    uint8_t byte;
+
+    if (*len != LZ4_RUN_MASK) {
+        return 0;
+    }
+
+    do {
+        if (*ip >= ip_end)
+            return -1;
+
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 0xFF);
+
+    return 0;
+}
+
+ssize_t
+lz4_decompress(const void *src, size_t src_len, void *dst, size_t dst_len)
+{
+    const uint8_t *ip = src, *ip_end = ip + src_len;
+    const uint8_t *match;
+    uint8_t *op = dst, *op_end = op + dst_len;
+    uint8_t token;
+    size_t len, off;
+
+    if (src == NULL || dst == NULL) {
+        return -EINVAL;
+    }
+
+    while (ip < ip_end) {
+        token = *ip++;
+
+        /* Copy the literals */
+        len = token >> 4;
+        if (lz4_length(&ip, ip_end, &len) != 0) {
+            return -EINVAL;
+        }
+
+        if (len > (size_t)(ip_end - ip) || len > (size_t)(op_end - op)) {
+            return -EINVAL;
+        }
+
+        for (size_t i = 0; i < len; ++i) {
+            op[i] = ip[i];
+        }
+
+        ip += len;
+        op += len;
+
+        /* The last sequence has no match */
+        if (ip == ip_end) {
+            break;
+        }
+
+        if (ip_end - ip < 2) {
+            return -EINVAL;
+        }
+
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - (uint8_t *)dst)) {
+            return -EINVAL;
+        }
+
+        len = token & LZ4_RUN_MASK;
+        if (lz4_length(&ip, ip_end, &len) != 0) {
+            return -EINVAL;
+        }
+
+        len += LZ4_MINMATCH;
+        if (len > (size_t)(op_end - op)) {
+            return -EINVAL;
+        }
+
+        /* Matches may overlap what they produce, copy bytewise */
+        match = op - off;
+        for (size_t i = 0; i < len; ++i) {
+            op[i] = match[i];
+        }
+
+        op += len;
+    }
+
+    return op - (uint8_t *)dst;
+}
@@ -56,6 +56,16 @@ spinlock_acquire(spinlock_t *lock, bool irqmut)
     }
 }
 
+bool
+spinlock_try(spinlock_t *lock)
+{
+    if (lock == NULL) {
+        return false;
+    }
+
+    return mu_aswap(lock, 1) == 0;
+}
+
 void
 spinlock_release(spinlock_t *lock)
 {
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2025 Ian Marco Moffett and the OpenModality engineers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/mman.h>
+#include <core/syscall.h>
+#include <mm/vmem.h>
+#include <mu/cpu.h>
+
+typedef int64_t(*syscall_t)(struct syscall_args *args);
+
+/*
+ * Returns the virtual address space of the caller
+ */
+static inline struct mu_vas *
+syscall_vas(void)
+{
+    struct pcr *self;
+
+    if ((self = mu_cpu_self()) == NULL) {
+        return NULL;
+    }
+
+    return self->curvas;
+}
+
+/*
+ * mmap(addr, length, prot, flags, fd, offset)
+ */
+static int64_t
+sys_mmap(struct syscall_args *args)
+{
+    uintptr_t va;
+    int error;
+
+    error = vmem_mmap(
+        syscall_vas(), args->arg[0], args->arg[1],
+        args->arg[2], args->arg[3], &va
+    );
+
+    if (error != 0) {
+        return error;
+    }
+
+    return va;
+}
+
+/*
+ * munmap(addr, length)
+ */
+static int64_t
+sys_munmap(struct syscall_args *args)
+{
+    return vmem_munmap(syscall_vas(), args->arg[0], args->arg[1]);
+}
+
+static syscall_t systab[] = {
+    [SYS_mmap] = sys_mmap,
+    [SYS_munmap] = sys_munmap
+};
+
+int64_t
+syscall_handle(uint64_t num, struct syscall_args *args)
+{
+    size_t ntab = sizeof(systab) / sizeof(systab[0]);
+
+    if (num >= ntab || systab[num] == NULL) {
+        return -ENOSYS;
+    }
+
+    return systab[num](args);
+}
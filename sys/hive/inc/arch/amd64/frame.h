@@ -49,9 +49,9 @@ struct PACKED trapframe {
     uint64_t rbp;
     uint64_t rdi;
     uint64_t rsi;
-    uint64_t rbx;
     uint64_t rdx;
     uint64_t rcx;
+    uint64_t rbx;
     uint64_t rax;
     uint64_t error_code;
     uint64_t rip;
@@ -40,6 +40,7 @@
 #define IA32_MTRR_PHYSMASK  0x00000201
 #define IA32_KERNEL_GS_BASE 0xC0000102
 #define IA32_EFER           0xC0000080
+#define IA32_PAT            0x00000277
 
 ALWAYS_INLINE static inline void
 md_wrmsr(uint32_t msr, uint64_t v)
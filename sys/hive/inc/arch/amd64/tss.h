@@ -100,4 +100,13 @@ struct PACKED tss_desc {
  */
 int md_tss_init(struct tss_entry *tss, struct tss_desc *desc);
 
+/*
+ * Set the stack used when the processor traps in
+ * from user mode.
+ *
+ * @tss: Task state segment to update
+ * @rsp0: Top of the kernel stack to use
+ */
+void md_tss_rsp0(struct tss_entry *tss, uintptr_t rsp0);
+
 #endif  /* !_MACHINE_TSS_H_ */
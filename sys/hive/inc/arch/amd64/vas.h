@@ -32,13 +32,40 @@
 
 #include <sys/types.h>
 
+/*
+ * Kernel virtual address arena, sits above the higher
+ * half direct map and below the kernel image.
+ */
+#define MD_KVA_BASE 0xFFFFC00000000000
+#define MD_KVA_SIZE 0x0000004000000000  /* 256 GiB */
+
+/*
+ * Bounds of the user half, mappings without a fixed
+ * address are placed from MD_MMAP_BASE upwards.
+ */
+#define MD_USER_MIN   0x0000000000001000
+#define MD_USER_MAX   0x0000800000000000
+#define MD_MMAP_BASE  0x0000100000000000
+
+/* Number of leaf tables remembered per address space */
+#define MD_WALK_CACHE_SIZE 16
+
+/* Forward declaration */
+struct vmem_map;
+
 /*
  * Represents a virtual address space
  *
  * @cr3: Control register 3 bits
+ * @cpumask: Processors that currently have this loaded
+ * @map: Regions within this address space
+ * @walk_cache: Recently used leaf tables, owned by the pmap
  */
 struct mu_vas {
     uintptr_t cr3;
+    volatile uint64_t cpumask;
+    struct vmem_map *map;
+    volatile uint64_t walk_cache[MD_WALK_CACHE_SIZE];
 };
 
 #endif  /* !_MACHINE_VAS_H_ */
@@ -33,11 +33,29 @@
 #include <sys/types.h>
 #include <mu/pmap.h>
 
+#include <sys/param.h>
+
+/*
+ * Load flags
+ *
+ * @ELF_LAZY: Load pages on first touch rather than up front
+ * @ELF_PREFAULT_ENTRY: Load the pages around the entry point
+ *                      up front when loading lazily.
+ */
+#define ELF_LAZY            BIT(0)
+#define ELF_PREFAULT_ENTRY  BIT(1)
+
 /*
  * Describe a loaded ELF file in-memory
+ *
+ * @entrypoint: Program entry point
+ * @npages: Pages spanned by loadable segments
+ * @nloaded: Pages loaded by the time the load returned
  */
 struct loaded_elf {
     uintptr_t entrypoint;
+    size_t npages;
+    size_t nloaded;
 };
 
 /*
@@ -45,10 +63,34 @@ struct loaded_elf {
  *
  * @vas: Virtual address space to load within
  * @image: Image to load
+ * @flags: ELF_* load flags
+ * @elf: Resulting loaded ELF descriptor written here
+ *
+ * Other hot ranges of a lazily loaded image may be
+ * populated with vmem_prefault().
+ *
+ * Returns zero on success
+ */
+int elf_load_raw(
+    struct mu_vas *vas, void *image,
+    int flags, struct loaded_elf *res
+);
+
+/*
+ * Load an ELF file from the initrd into memory, images are
+ * cached by path so that later loads share the read-only
+ * pages of earlier ones and only copy writable data.
+ *
+ * @vas: Virtual address space to load within
+ * @path: Path of the image within the initrd
+ * @flags: ELF_* load flags
  * @elf: Resulting loaded ELF descriptor written here
  *
  * Returns zero on success
  */
-int elf_load_raw(struct mu_vas *vas, void *image, struct loaded_elf *res);
+int elf_load_path(
+    struct mu_vas *vas, const char *path,
+    int flags, struct loaded_elf *res
+);
 
 #endif  /* !_CORE_ELFLOAD_H_ */
@@ -30,6 +30,31 @@
 #ifndef _CORE_INITRD_H_
 #define _CORE_INITRD_H_ 1
 
+#include <sys/types.h>
+#include <lib/stdbool.h>
+
+/*
+ * Represents the payload of a file within the initrd
+ *
+ * @data: Virtual base of the payload, NULL if compressed
+ * @length: Length of the file
+ * @pa: Physical base of the payload, zero if compressed
+ * @mappable: True if the payload is page aligned and owns
+ *            every page it touches, its frames may then be
+ *            mapped straight into an address space.
+ * @compressed: True if the payload must be read through
+ *              initrd_read()
+ * @file: Header of the file (internal)
+ */
+struct initrd_extent {
+    void *data;
+    size_t length;
+    uintptr_t pa;
+    bool mappable;
+    bool compressed;
+    void *file;
+};
+
 /*
  * Initialize the initrd subsystem
  */
@@ -37,8 +62,36 @@ void initrd_init(void);
 
 /*
  * Lookup a path within the initrd and return the
- * base of the data
+ * base of the data, compressed files are decompressed
+ * as a whole on first lookup.
  */
 void *initrd_lookup(const char *path);
 
+/*
+ * Lookup a path within the initrd and describe
+ * its payload
+ *
+ * @path: Path to lookup
+ * @res: Result is written here
+ *
+ * Returns zero on success, otherwise a less than
+ * zero value on failure.
+ */
+int initrd_lookup_extent(const char *path, struct initrd_extent *res);
+
+/*
+ * Read from a file within the initrd, only the blocks
+ * covering the range are decompressed.
+ *
+ * @extent: File to read from
+ * @off: Offset to read from
+ * @buf: Buffer to read into
+ * @len: Number of bytes to read
+ *
+ * Returns the number of bytes read on success, otherwise
+ * a less than zero value on failure.
+ */
+ssize_t initrd_read(const struct initrd_extent *extent, size_t off,
+    void *buf, size_t len);
+
 #endif  /* !_CORE_INITRD_H_ */
@@ -43,6 +43,15 @@ typedef size_t spinlock_t;
  */
 void spinlock_acquire(spinlock_t *lock, bool irqmut);
 
+/*
+ * Attempt to acquire a spinlock without spinning
+ *
+ * @lock: Lock to acquire
+ *
+ * Returns true if the lock was acquired
+ */
+bool spinlock_try(spinlock_t *lock);
+
 /*
  * Release a spinlock
  */
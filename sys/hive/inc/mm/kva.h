@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2025 Ian Marco Moffett and the OpenModality engineers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MM_KVA_H_
+#define _MM_KVA_H_ 1
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <lib/stdbool.h>
+#include <core/spinlock.h>
+#include <mu/cpu.h>
+
+/*
+ * Allocation policies
+ *
+ * @KVA_INSTANTFIT: Take the first segment of a freelist that is
+ *                  guaranteed to fit, constant time.
+ * @KVA_BESTFIT: Take the smallest free segment that fits, this
+ *               keeps fragmentation lower at a higher cost.
+ */
+#define KVA_INSTANTFIT BIT(0)
+#define KVA_BESTFIT    BIT(1)
+
+#define KVA_NFREELIST    64  /* One per power of two */
+#define KVA_NHASH        64  /* Allocated segment buckets */
+#define KVA_QCACHE_MAX   8   /* Largest cached size in quanta */
+#define KVA_QCACHE_DEPTH 8   /* Cached ranges per size per CPU */
+
+/*
+ * Represents a boundary tag, describing a free or
+ * allocated segment of an arena.
+ *
+ * @base: Base address of segment
+ * @size: Size of segment in bytes
+ * @free: True if the segment is free
+ * @segq: Link in the address ordered segment list
+ * @link: Freelist or allocated hash chain link
+ */
+struct kva_seg {
+    uintptr_t base;
+    size_t size;
+    bool free;
+    TAILQ_ENTRY(kva_seg) segq;
+    TAILQ_ENTRY(kva_seg) link;
+};
+
+TAILQ_HEAD(kva_seglist, kva_seg);
+
+/*
+ * Per-processor cache of ranges of a single small
+ * size, these bypass the arena lock.
+ *
+ * @slot: Cached range bases
+ * @count: Number of slots in use
+ * @lock: Protects the cache
+ */
+struct kva_qcache {
+    uintptr_t slot[KVA_QCACHE_DEPTH];
+    size_t count;
+    spinlock_t lock;
+};
+
+/*
+ * Represents an arena of virtual addresses
+ *
+ * @name: Name of arena
+ * @quantum: Allocation granularity in bytes
+ * @qcache_max: Largest size served by the quantum caches
+ * @segq: Every segment ordered by address
+ * @freelist: Free segments by power of two size
+ * @hash: Allocated segments by base
+ * @qcache: Quantum caches by processor then size
+ * @inuse: Bytes allocated from the arena
+ * @total: Bytes managed by the arena
+ * @lock: Protects everything but the quantum caches
+ */
+struct kva_arena {
+    const char *name;
+    size_t quantum;
+    size_t qcache_max;
+    struct kva_seglist segq;
+    struct kva_seglist freelist[KVA_NFREELIST];
+    struct kva_seglist hash[KVA_NHASH];
+    struct kva_qcache qcache[CPU_MAX][KVA_QCACHE_MAX];
+    size_t inuse;
+    size_t total;
+    spinlock_t lock;
+};
+
+/*
+ * Initialize an arena
+ *
+ * @ap: Arena to initialize
+ * @name: Name of arena
+ * @base: Base of the initial span
+ * @size: Size of the initial span, may be zero
+ * @quantum: Allocation granularity, must be a power of two
+ * @qcache_max: Largest size to be served by quantum caches
+ *
+ * Returns zero on success
+ */
+int kva_arena_init(
+    struct kva_arena *ap, const char *name, uintptr_t base,
+    size_t size, size_t quantum, size_t qcache_max
+);
+
+/*
+ * Add a span of addresses to an arena
+ *
+ * @ap: Arena to add to
+ * @base: Base of span
+ * @size: Size of span
+ *
+ * Returns zero on success
+ */
+int kva_arena_add(struct kva_arena *ap, uintptr_t base, size_t size);
+
+/*
+ * Allocate a range of addresses from an arena
+ *
+ * @ap: Arena to allocate from
+ * @size: Size of range, rounded up to the quantum
+ * @flags: KVA_INSTANTFIT or KVA_BESTFIT
+ * @res: Base of range is written here
+ *
+ * Returns zero on success
+ */
+int kva_alloc(struct kva_arena *ap, size_t size, int flags, uintptr_t *res);
+
+/*
+ * Free a range of addresses back to an arena
+ *
+ * @ap: Arena to free to
+ * @base: Base of range
+ * @size: Size it was allocated with
+ */
+void kva_free(struct kva_arena *ap, uintptr_t base, size_t size);
+
+/*
+ * Initialize the kernel virtual address arena
+ */
+void mm_kva_init(void);
+
+/*
+ * Allocate virtually contiguous kernel memory, the frames
+ * backing it need not be physically contiguous.
+ *
+ * @length: Number of bytes to allocate
+ *
+ * Returns NULL on failure
+ */
+void *mm_vmalloc(size_t length);
+
+/*
+ * Free memory allocated with mm_vmalloc()
+ *
+ * @ptr: Memory to free
+ * @length: Length it was allocated with
+ */
+void mm_vfree(void *ptr, size_t length);
+
+/*
+ * Map a range of physical memory, typically device memory,
+ * into kernel virtual memory. The memory type is selected
+ * with the PROT_WC, PROT_UC and PROT_WT flags, a framebuffer
+ * for example would be mapped with PROT_WC.
+ *
+ * @pa: Physical base of range
+ * @length: Length of range
+ * @prot: Protection and memory type flags
+ *
+ * Returns NULL on failure
+ */
+void *mm_vmap_phys(uintptr_t pa, size_t length, int prot);
+
+/*
+ * Unmap a range mapped with mm_vmap_phys(), the
+ * physical memory itself is left alone.
+ *
+ * @ptr: Pointer returned by mm_vmap_phys()
+ * @length: Length it was mapped with
+ */
+void mm_vunmap_phys(void *ptr, size_t length);
+
+#endif  /* !_MM_KVA_H_ */
@@ -35,6 +35,6 @@
 
 #define PAGESIZE 4096
 #define PHYS_TO_VIRT(PHYS) PTR_OFFSET(PHYS, bpt_kernel_base())
-#define VIRT_TO_PHYS(VIRT) (uintptr_t)PTR_NOFFSET(PHYS, bpt_kernel_base())
+#define VIRT_TO_PHYS(VIRT) (uintptr_t)PTR_NOFFSET(VIRT, bpt_kernel_base())
 
 #endif  /* !_MM_MEMVAR_H_ */
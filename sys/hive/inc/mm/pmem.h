@@ -45,6 +45,18 @@ void mm_pmem_init(void);
  */
 uintptr_t mm_pmem_alloc(size_t count);
 
+/*
+ * Allocate one or more physical memory frames with the
+ * base aligned to a specific boundary
+ *
+ * @count: Number of frames to allocate
+ * @align: Alignment in bytes, a power of two of at least PAGESIZE
+ *
+ * Returns the base address of the allocated physical
+ * memory region
+ */
+uintptr_t mm_pmem_alloc_align(size_t count, size_t align);
+
 /*
  * Free one or more physical memory frames
  *
@@ -53,4 +65,40 @@ uintptr_t mm_pmem_alloc(size_t count);
  */
 void mm_pmem_free(uintptr_t base, size_t count);
 
+/*
+ * Take another reference on a frame that is to be shared,
+ * frames start out with a single reference when allocated.
+ *
+ * @pa: Physical address within the frame
+ */
+void mm_pmem_ref(uintptr_t pa);
+
+/*
+ * Drop a reference on a frame, the frame is freed once
+ * the last reference is dropped.
+ *
+ * @pa: Physical address within the frame
+ *
+ * Returns the number of references left
+ */
+size_t mm_pmem_unref(uintptr_t pa);
+
+/*
+ * Returns the number of references held on a frame
+ *
+ * @pa: Physical address within the frame
+ */
+size_t mm_pmem_refcount(uintptr_t pa);
+
+/*
+ * Pin a range of frames that do not belong to the frame
+ * allocator (e.g., boot modules) so that they can be
+ * mapped and shared like any other frame without ever
+ * being released by the last unref.
+ *
+ * @base: Base address of the range
+ * @count: Number of frames within the range
+ */
+void mm_pmem_pin(uintptr_t base, size_t count);
+
 #endif  /* !_MM_PSEG_H_ */
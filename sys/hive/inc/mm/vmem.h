@@ -31,19 +31,123 @@
 #define _MM_VMEM_H_ 1
 
 #include <sys/types.h>
+#include <sys/param.h>
+#include <core/spinlock.h>
 #include <mu/pmap.h>
 
+/*
+ * Page fault access flags
+ *
+ * @VMEM_FAULT_WRITE: Faulting access was a write
+ * @VMEM_FAULT_EXEC: Faulting access was an instruction fetch
+ * @VMEM_FAULT_USER: Faulting access came from user mode
+ * @VMEM_FAULT_PROT: A translation was present (protection fault)
+ */
+#define VMEM_FAULT_WRITE BIT(0)
+#define VMEM_FAULT_EXEC  BIT(1)
+#define VMEM_FAULT_USER  BIT(2)
+#define VMEM_FAULT_PROT  BIT(3)
+
+/*
+ * Region flags
+ *
+ * @VMEM_COW: Frames may be shared copy-on-write with another
+ *            address space, set once a region has been cloned.
+ * @VMEM_SHARED: Frames are shared writable with clones
+ * @VMEM_HUGE: Populate with 2 MiB pages where alignment allows
+ */
+#define VMEM_COW    BIT(0)
+#define VMEM_SHARED BIT(1)
+#define VMEM_HUGE   BIT(2)
+
+/*
+ * Represents what backs the pages of a region
+ *
+ * @VMEM_FIXED: Backed by a fixed physical range starting at 'pma'
+ * @VMEM_ANON: Anonymous zero-filled memory allocated on first touch
+ * @VMEM_OBJECT: Backed by an object, pages come from its pager
+ */
+typedef enum {
+    VMEM_FIXED,
+    VMEM_ANON,
+    VMEM_OBJECT
+} vmem_backing_t;
+
+/*
+ * Supplies the pages of object backed regions
+ *
+ * @getpage: Acquire the frame at byte offset 'off' within
+ *           'obj', a reference is taken on the frame for
+ *           the caller.
+ * @ref: Take a reference on 'obj'
+ * @unref: Drop a reference on 'obj'
+ * @prefetch: Pages after a faulting one to populate along
+ *            with it, zero for none.
+ */
+struct vmem_pager {
+    int(*getpage)(void *obj, size_t off, uintptr_t *res);
+    void(*ref)(void *obj);
+    void(*unref)(void *obj);
+    size_t prefetch;
+};
+
 /*
  * Represents a memory region
  *
  * @vma: Virtual memory base of region
- * @pma: Physical memory base of region@
+ * @pma: Physical memory base of region, or the offset into
+ *       the object for object backed regions
  * @length: Length of region
+ * @prot: Protection flags of region
+ * @backing: What backs the pages of this region
+ * @flags: VMEM_* region flags
+ * @pager: Pager of the backing object (VMEM_OBJECT)
+ * @object: Backing object (VMEM_OBJECT)
+ *
+ * The remaining fields are private to the region map
+ * and describe the subtree rooted at this region.
+ *
+ * @left: Regions below this one
+ * @right: Regions above this one
+ * @min_va: Lowest virtual base within the subtree
+ * @max_end: Highest virtual end within the subtree
+ * @max_gap: Largest unmapped gap within the subtree
+ * @height: Height of the subtree
  */
 struct vmem_region {
     uintptr_t vma;
     uintptr_t pma;
     size_t length;
+    int prot;
+    vmem_backing_t backing;
+    int flags;
+    const struct vmem_pager *pager;
+    void *object;
+    struct vmem_region *left;
+    struct vmem_region *right;
+    uintptr_t min_va;
+    uintptr_t max_end;
+    size_t max_gap;
+    int height;
+};
+
+/*
+ * Represents the set of regions within a virtual
+ * address space. Regions are kept in a balanced (AVL)
+ * tree keyed by virtual base, each node tracks the
+ * largest gap below it so that free space can be found
+ * without visiting every region.
+ *
+ * @root: Root of the region tree
+ * @nregions: Number of regions within the map
+ * @gen: Generation, changes whenever the map does
+ * @lock: Protects the map and fault resolution
+ */
+struct vmem_map {
+    struct vmem_region *root;
+    size_t nregions;
+    unsigned long gen;
+    spinlock_t lock;
 };
 
 /*
@@ -57,4 +161,191 @@ struct vmem_region {
  */
 int vmem_map_region(struct mu_vas *vas, struct vmem_region *region, int prot);
 
+/*
+ * Unmap a virtual memory region
+ *
+ * @vas: Virtual address space to unmap within
+ * @region: Region to unmap
+ *
+ * Returns zero on success
+ */
+int vmem_unmap_region(struct mu_vas *vas, struct vmem_region *region);
+
+/*
+ * Change the protection of a mapped virtual memory region
+ *
+ * @vas: Virtual address space to operate within
+ * @region: Region to change
+ * @prot: New protection flags
+ *
+ * Returns zero on success
+ */
+int vmem_protect_region(struct mu_vas *vas, struct vmem_region *region, int prot);
+
+/*
+ * Record a region within the region map of a virtual
+ * address space. The descriptor is copied and nothing
+ * is mapped, object backed regions take a reference on
+ * their object.
+ *
+ * @vas: Virtual address space to add to
+ * @region: Region to add, 'vma' and 'length' must be page aligned
+ *
+ * Returns zero on success
+ */
+int vmem_region_add(struct mu_vas *vas, struct vmem_region *region);
+
+/*
+ * Lookup the region containing a virtual address
+ *
+ * @vas: Virtual address space to lookup within
+ * @va: Virtual address to lookup
+ *
+ * Returns NULL if the address is not within any region
+ */
+struct vmem_region *vmem_region_find(struct mu_vas *vas, uintptr_t va);
+
+/*
+ * Remove the region containing a virtual address from the
+ * region map of a virtual address space, nothing is unmapped.
+ *
+ * @vas: Virtual address space to remove from
+ * @va: Virtual address within the region
+ *
+ * Returns zero on success
+ */
+int vmem_region_del(struct mu_vas *vas, uintptr_t va);
+
+/*
+ * Find an unmapped gap within a virtual address space
+ *
+ * @vas: Virtual address space to search
+ * @length: Length of the gap needed
+ * @align: Alignment of the gap, must be a power of two
+ * @lo: Lowest virtual address the gap may start at
+ * @hi: Highest virtual address the gap may end at
+ * @res: Base of the lowest fitting gap is written here
+ *
+ * Returns zero on success
+ */
+int vmem_find_gap(
+    struct mu_vas *vas, size_t length, size_t align,
+    uintptr_t lo, uintptr_t hi, uintptr_t *res
+);
+
+/*
+ * Reserve anonymous memory within a virtual address space,
+ * pages are allocated and zeroed on first touch.
+ *
+ * @vas: Virtual address space to reserve within
+ * @va: Virtual base of reservation
+ * @length: Length of reservation
+ * @prot: Protection flags
+ *
+ * Returns zero on success
+ */
+int vmem_reserve(struct mu_vas *vas, uintptr_t va, size_t length, int prot);
+
+/*
+ * Populate every page within a range of a virtual address
+ * space up front rather than on first touch.
+ *
+ * @vas: Virtual address space to operate within
+ * @va: Virtual base of range
+ * @length: Length of range, it must lie within regions
+ *
+ * Returns zero on success
+ */
+int vmem_prefault(struct mu_vas *vas, uintptr_t va, size_t length);
+
+/*
+ * Map anonymous memory into a virtual address space
+ *
+ * @vas: Virtual address space to map within
+ * @addr: Address hint, or the exact address with MAP_FIXED
+ * @length: Length of mapping
+ * @prot: PROT_* protection flags
+ * @flags: MAP_* flags, MAP_ANON is required
+ * @res: Base of the mapping is written here
+ *
+ * With MAP_FIXED an existing mapping is never replaced,
+ * -EEXIST is returned instead.
+ *
+ * Returns zero on success
+ */
+int vmem_mmap(
+    struct mu_vas *vas, uintptr_t addr, size_t length,
+    int prot, int flags, uintptr_t *res
+);
+
+/*
+ * Map an object into a virtual address space, pages are
+ * acquired from its pager on first touch.
+ *
+ * @vas: Virtual address space to map within
+ * @addr: Address hint, or the exact address with MAP_FIXED
+ * @length: Length of mapping
+ * @prot: PROT_* protection flags
+ * @flags: MAP_* flags, MAP_SHARED writes go to the object
+ *         while MAP_PRIVATE ones are copied
+ * @pager: Pager of the object
+ * @obj: Object to map, NULL for anonymous memory
+ * @off: Page aligned offset into the object
+ * @res: Base of the mapping is written here
+ *
+ * Returns zero on success
+ */
+int vmem_mmap_object(
+    struct mu_vas *vas, uintptr_t addr, size_t length,
+    int prot, int flags, const struct vmem_pager *pager,
+    void *obj, size_t off, uintptr_t *res
+);
+
+/*
+ * Unmap a range of a virtual address space, regions only
+ * partially within the range are trimmed or split.
+ *
+ * @vas: Virtual address space to unmap within
+ * @va: Virtual base of range
+ * @length: Length of range
+ *
+ * Returns zero on success
+ */
+int vmem_munmap(struct mu_vas *vas, uintptr_t va, size_t length);
+
+/*
+ * Resolve a page fault
+ *
+ * @vas: Virtual address space the fault occured within
+ * @va: Faulting virtual address
+ * @fault: VMEM_FAULT_* flags describing the access
+ *
+ * Returns zero if the fault has been resolved
+ */
+int vmem_fault(struct mu_vas *vas, uintptr_t va, int fault);
+
+/*
+ * Clone a virtual address space as copy-on-write. Memory is
+ * not copied, instead every mapped frame is shared between
+ * both and a private copy is only made for the page that
+ * is written to first.
+ *
+ * @src: Virtual address space to clone
+ * @dst: Resulting virtual address space is written here
+ *
+ * Returns zero on success
+ */
+int vmem_clone(struct mu_vas *src, struct mu_vas *dst);
+
+/*
+ * Destroy a virtual address space along with its region map,
+ * dropping a reference on every frame it maps. It must not be
+ * loaded on any processor.
+ *
+ * @vas: Virtual address space to destroy
+ *
+ * Returns zero on success
+ */
+int vmem_destroy(struct mu_vas *vas);
+
 #endif  /* !_MM_VMEM_H_ */
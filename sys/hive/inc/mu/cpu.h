@@ -30,15 +30,24 @@
 #ifndef _MU_CPU_H_
 #define _MU_CPU_H_ 1
 
+#include <sys/types.h>
 #include <lib/stdbool.h>
 
+/* Maximum number of processing elements */
+#define CPU_MAX 64
+
+/* Forward declaration */
+struct mu_vas;
+
 /*
  * Processor control region
  *
  * @id: Logical ID (assigned by us)
+ * @curvas: Virtual address space currently loaded
  */
 struct pcr {
     uint16_t id;
+    struct mu_vas *curvas;
 };
 
 /*
@@ -48,6 +57,23 @@ struct pcr {
  */
 void mu_cpu_conf(struct pcr *pcr);
 
+/*
+ * Acquire the processor control region of the
+ * current processor, returns NULL if it has not
+ * been configured yet.
+ */
+struct pcr *mu_cpu_self(void);
+
+/*
+ * Acquire the processor control region of a
+ * configured processor by logical ID.
+ *
+ * @id: Logical ID of processor to lookup
+ *
+ * Returns NULL if not found
+ */
+struct pcr *mu_cpu_get(uint16_t id);
+
 /*
  * Returns true if interrupts are unmasked
  * and ready to be recieved
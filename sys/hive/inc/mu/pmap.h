@@ -32,8 +32,18 @@
 
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <lib/stdbool.h>
 #include <md/vas.h>    /* shared */
 
+/* Maximum number of distinct ranges per gather */
+#define PMAP_GATHER_MAX 8
+
+/*
+ * Number of pages at which a gather stops invalidating
+ * page by page and instead flushes the whole TLB.
+ */
+#define PMAP_INVL_THRESH 32
+
 /*
  * Represents valid page sizes that can be used
  * within a map/unmap operation.
@@ -44,6 +54,30 @@ typedef enum {
     PAGESIZE_1G
 } pagesize_t;
 
+/*
+ * Represents a batch of TLB invalidations gathered
+ * during map, unmap and protect operations within a
+ * single virtual address space.
+ *
+ * @vas: Virtual address space the batch belongs to
+ * @range: Pending ranges to be invalidated
+ * @nrange: Number of ranges in use
+ * @npages: Number of pages pending invalidation
+ * @kernel: Set if any range lies in the kernel half
+ * @flush_all: Set if the whole TLB is to be flushed
+ */
+struct pmap_gather {
+    struct mu_vas *vas;
+    struct {
+        uintptr_t va;
+        size_t len;
+    } range[PMAP_GATHER_MAX];
+    size_t nrange;
+    size_t npages;
+    bool kernel;
+    bool flush_all;
+};
+
 /*
  * Initialize the pagemap subsystem
  */
@@ -59,6 +93,28 @@ int mu_pmap_readvas(struct mu_vas *res);
  */
 int mu_pmap_writevas(struct mu_vas *vas);
 
+/*
+ * Create a new virtual address space with an empty
+ * user half and the kernel half shared with every
+ * other address space.
+ *
+ * @res: Result is written here
+ *
+ * Returns zero on success
+ */
+int mu_pmap_newvas(struct mu_vas *res);
+
+/*
+ * Destroy a virtual address space created with
+ * mu_pmap_newvas(). This frees the paging structures
+ * of the user half though not the frames they map.
+ *
+ * @vas: Virtual address space to destroy
+ *
+ * Returns zero on success
+ */
+int mu_pmap_destroyvas(struct mu_vas *vas);
+
 /*
  * Create a virtual to physical memory mapping
  *
@@ -75,4 +131,152 @@ int mu_pmap_map(
     int prot, pagesize_t ps
 );
 
+/*
+ * Remove a virtual to physical memory mapping
+ *
+ * @vas: Virtual address space to unmap within
+ * @vma: Virtual memory address
+ * @ps: Page size
+ *
+ * Returns zero on success
+ */
+int mu_pmap_unmap(struct mu_vas *vas, uintptr_t vma, pagesize_t ps);
+
+/*
+ * Translate a virtual address into a physical one
+ *
+ * @vas: Virtual address space to translate within
+ * @va: Virtual address to translate
+ * @pa: Physical address is written here (optional)
+ * @prot: Protection flags are written here (optional)
+ * @ps: Size of the page mapping it is written here (optional)
+ *
+ * Returns zero if a translation is present
+ */
+int mu_pmap_translate(
+    struct mu_vas *vas, uintptr_t va,
+    uintptr_t *pa, int *prot, pagesize_t *ps
+);
+
+/*
+ * Translate a run of consecutive pages at once, this is
+ * much cheaper than translating each page by itself.
+ *
+ * @vas: Virtual address space to translate within
+ * @va: Virtual base of the run
+ * @npages: Number of pages within the run
+ * @pa: Physical address of each page is written here
+ *
+ * Returns the number of pages translated, the run ends
+ * early at the first page without a translation.
+ */
+size_t mu_pmap_translate_range(
+    struct mu_vas *vas, uintptr_t va,
+    size_t npages, uintptr_t *pa
+);
+
+/*
+ * Initialize a TLB gather for a virtual address space
+ *
+ * @pg: Gather to initialize
+ * @vas: Virtual address space the gather belongs to
+ */
+void mu_pmap_gather_init(struct pmap_gather *pg, struct mu_vas *vas);
+
+/*
+ * Add a range to be invalidated to a gather
+ *
+ * @pg: Gather to add to
+ * @va: Virtual base of range
+ * @len: Length of range in bytes
+ */
+void mu_pmap_gather_add(struct pmap_gather *pg, uintptr_t va, size_t len);
+
+/*
+ * Invalidate every range gathered on all processors that
+ * have the virtual address space loaded and reset the
+ * gather for reuse.
+ *
+ * @pg: Gather to flush
+ */
+void mu_pmap_gather_flush(struct pmap_gather *pg);
+
+/*
+ * Create a virtual to physical memory mapping, deferring
+ * any required invalidation to a gather.
+ *
+ * @pg: Gather of the virtual address space to map within
+ * @vma: Virtual memory address
+ * @pma: Physical memory address
+ * @prot: Protection flags
+ * @ps: Page size
+ *
+ * Returns zero on success
+ */
+int mu_pmap_enter(
+    struct pmap_gather *pg, uintptr_t vma, uintptr_t pma,
+    int prot, pagesize_t ps
+);
+
+/*
+ * Remove a virtual to physical memory mapping, deferring
+ * the invalidation to a gather.
+ *
+ * @pg: Gather of the virtual address space to unmap within
+ * @vma: Virtual memory address
+ * @ps: Page size
+ *
+ * Returns zero on success
+ */
+int mu_pmap_remove(struct pmap_gather *pg, uintptr_t vma, pagesize_t ps);
+
+/*
+ * Change the protection of an existing mapping, deferring
+ * the invalidation to a gather.
+ *
+ * @pg: Gather of the virtual address space to operate within
+ * @vma: Virtual memory address
+ * @prot: New protection flags
+ * @ps: Page size
+ *
+ * Returns zero on success
+ */
+int mu_pmap_protect(
+    struct pmap_gather *pg, uintptr_t vma,
+    int prot, pagesize_t ps
+);
+
+/*
+ * Split the 2 MiB mapping containing a virtual address
+ * into 4K mappings of the same frames and attributes,
+ * deferring the invalidation to a gather.
+ *
+ * @pg: Gather of the virtual address space to operate within
+ * @vma: Virtual memory address within the huge page
+ *
+ * Returns zero on success
+ */
+int mu_pmap_demote(struct pmap_gather *pg, uintptr_t vma);
+
+/*
+ * Copy the user translations within a range of one virtual
+ * address space into another. The frames become shared, each
+ * gaining a reference. If 'cow' is set they are also write
+ * protected as copy-on-write (PROT_COW) in both. Any
+ * invalidation required in the source is deferred to the
+ * gather.
+ *
+ * @pg: Gather of the source virtual address space
+ * @dst: Virtual address space to copy into
+ * @va: Virtual base of range
+ * @len: Length of range in bytes
+ * @cow: Share the frames copy-on-write
+ *
+ * Returns zero on success
+ */
+int mu_pmap_clone(
+    struct pmap_gather *pg, struct mu_vas *dst,
+    uintptr_t va, size_t len, bool cow
+);
+
 #endif  /* _MU_PMAP_H_ */
@@ -31,19 +31,53 @@
 #define _OB_DIR_H_ 1
 
 #include <sys/types.h>
+#include <core/spinlock.h>
 #include <ob/knode.h>
 
 #define KNODE_DIR(KNODE_P) ((KNODE_P)->data)
 
 /*
- * Represents a knode directory
+ * Represents a hash table of knodes
+ *
+ * @nbuckets: Number of buckets, a power of two
+ * @link: Index of the knode hash link chains run through
+ * @dir: Directory the table belongs to
+ * @buckets: Head of each chain
+ */
+struct knode_htab {
+    size_t nbuckets;
+    int link;
+    struct knode_dir *dir;
+    struct knode *volatile buckets[];
+};
+
+/*
+ * Represents a knode directory, entries are kept in
+ * insertion order for iteration and hashed by name for
+ * lookups. The table grows incrementally: while 'tab[1]'
+ * is set, each insertion moves a few buckets of 'tab[0]'
+ * over to it.
+ *
+ * Readers only ever load from a directory (see ob/rcu.h),
+ * writers serialize on 'lock'.
  *
  * @list: List of kernel nodes
  * @entry_count: Number of entries in this directory
+ * @gen: Bumped whenever an entry is added or removed
+ * @lock: Serializes writers
+ * @tab: Current table and the table being grown into
+ * @retired: Table last grown out of, still waiting on
+ *           readers. No resize starts until it is gone.
+ * @rehash_idx: Next bucket of 'tab[0]' to be moved
  */
 struct knode_dir {
     TAILQ_HEAD(, knode) list;
     size_t entry_count;
+    volatile uint32_t gen;
+    spinlock_t lock;
+    struct knode_htab *volatile tab[2];
+    struct knode_htab *volatile retired;
+    size_t rehash_idx;
 };
 
 /*
@@ -57,7 +91,8 @@ struct knode_dir {
 int ob_dir_new(const char *name, struct knode **res);
 
 /*
- * Append a knode to a directory knode
+ * Append a knode to a directory knode, the directory
+ * takes over the reference from ob_knode_new().
  *
  * @knp: Knode to append
  * @dir_kn: Target directory knode
@@ -66,6 +101,55 @@ int ob_dir_new(const char *name, struct knode **res);
  */
 int ob_dir_append(struct knode *knp, struct knode *dir_kn);
 
+/*
+ * Lookup a knode by name within a directory knode, no
+ * reference is taken: the result may only be used from
+ * within a read side section or while it is known to
+ * stay in place.
+ *
+ * @dir_kn: Directory knode to search
+ * @name: Name to lookup
+ * @res: Result is written here
+ *
+ * Returns zero on success
+ */
+int ob_dir_lookup(struct knode *dir_kn, const char *name, struct knode **res);
+
+/*
+ * Lookup a knode by a name that need not be terminated,
+ * such as a component within a path. See ob_dir_lookup().
+ *
+ * @dir_kn: Directory knode to search
+ * @name: Name to lookup
+ * @len: Length of 'name'
+ * @hash: Hash of 'name' (see ob_name_hash())
+ * @res: Result is written here
+ *
+ * Returns zero on success
+ */
+int ob_dir_lookup_slice(struct knode *dir_kn, const char *name, size_t len,
+    uint32_t hash, struct knode **res);
+
+/*
+ * Remove a knode from a directory knode and drop the
+ * reference the directory held on it. Directories must
+ * be empty to be removed.
+ *
+ * @knp: Knode to remove
+ * @dir_kn: Directory knode it resides in
+ *
+ * Returns zero on success
+ */
+int ob_dir_remove(struct knode *knp, struct knode *dir_kn);
+
+/*
+ * Tear down the backing data of a directory knode, the
+ * K_DIR destructor.
+ *
+ * @dir_kn: Directory knode to destroy
+ */
+void ob_dir_destroy(struct knode *dir_kn);
+
 /*
  * Obtain a knode by name from the root knode directory
  *
@@ -84,6 +168,8 @@ int ob_root_get(const char *name, struct knode **res);
  *
  * XXX: 'cb' returns a less than zero value to continue the iteration
  *      and a >= 0 value to terminate it
+ *
+ * XXX: 'cb' runs within a read side section and must not block
  */
 int ob_root_foreach(ktype_t type, int(*cb)(struct knode *kn));
 
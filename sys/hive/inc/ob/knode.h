@@ -41,13 +41,29 @@
  *
  * @K_NONE:     No assigned type
  * @K_CLKDEV:   Clock device node
+ * @K_SECTION:  Shared memory section
+ * @K_FILE:     Read-only file (e.g., within the initrd)
+ * @K_MAX:      Number of knode types
  */
 typedef enum {
     K_NONE,
     K_DIR,
     K_CLKDEV,
+    K_SECTION,
+    K_FILE,
+    K_MAX
 } ktype_t;
 
+struct knode;
+struct knode_pcref;
+
+/*
+ * Tears down the backing data of a knode once its
+ * last reference is gone, the knode itself is freed
+ * by the object store.
+ */
+typedef void(*knode_dtor_t)(struct knode *knp);
+
 /*
  * A kernel node is an abstract representation
  * of any system object. It is not bound to any
@@ -58,16 +74,31 @@ typedef enum {
  * @type: Type of kernel node
  * @data: Opaque reference to backing data
  * @ref:  Reference counter
+ * @pcref: Per-CPU reference counts, NULL unless biased
+ * @hash: Hash of 'name' (see ob_name_hash())
  * @dir_link: Directory queue link
+ * @hash_link: Directory hash chain links, a table being
+ *             grown into chains through the other one.
  */
 struct knode {
     char name[KNODE_NAME_LEN];
     ktype_t type;
     void *data;
-    int ref;
+    volatile unsigned int ref;
+    struct knode_pcref *volatile pcref;
+    uint32_t hash;
     TAILQ_ENTRY(knode) dir_link;
+    struct knode *volatile hash_link[2];
 };
 
+/*
+ * Hash a knode name
+ *
+ * @name: Name to hash, need not be terminated
+ * @len: Length of 'name'
+ */
+uint32_t ob_name_hash(const char *name, size_t len);
+
 /*
  * Initialize a new knode
  *
@@ -80,7 +111,57 @@ struct knode {
 int ob_knode_new(const char *name, ktype_t type, struct knode **res);
 
 /*
- * Resolve a knode by path
+ * Set the destructor of a knode type
+ *
+ * @type: Knode type to set it for
+ * @dtor: Destructor to set, NULL for none
+ *
+ * Returns zero on success
+ */
+int ob_knode_set_dtor(ktype_t type, knode_dtor_t dtor);
+
+/*
+ * Take another reference on a knode the caller
+ * already holds one on
+ *
+ * @knp: Knode to reference
+ */
+void ob_knode_ref(struct knode *knp);
+
+/*
+ * Drop a reference on a knode, it is destroyed once
+ * the last one is gone and no reader can see it.
+ *
+ * @knp: Knode to unreference
+ */
+void ob_knode_unref(struct knode *knp);
+
+/*
+ * Count references to a knode per processor so that
+ * taking and dropping them does not bounce a shared
+ * cacheline. Meant for objects that are referenced
+ * often and removed rarely, if ever.
+ *
+ * @knp: Knode to bias
+ *
+ * Returns zero on success
+ */
+int ob_knode_bias(struct knode *knp);
+
+/*
+ * Fold the per-CPU counts of a biased knode back into
+ * its shared counter, the caller must hold a reference.
+ * This waits on readers and is done before an object
+ * is detached (see ob_dir_remove()).
+ *
+ * @knp: Knode to unbias
+ */
+void ob_knode_unbias(struct knode *knp);
+
+/*
+ * Resolve a knode by path, a reference is taken on
+ * the result on success and is to be dropped with
+ * ob_knode_unref().
  *
  * @path: Path to resolve
  * @flags: Optional flags
@@ -90,4 +171,38 @@ int ob_knode_new(const char *name, ktype_t type, struct knode **res);
  */
 int ob_knode_resolve(const char *path, int flags, struct knode **res);
 
+/*
+ * Resolve a path relative to a directory knode, so that
+ * callers holding one need not walk up to it again.
+ * Absolute paths are resolved from the root, as is
+ * everything if 'base' is NULL. See ob_knode_resolve().
+ *
+ * @base: Directory knode to start from
+ * @path: Path to resolve
+ * @flags: Optional flags
+ * @res: Result pointer is written here
+ *
+ * Returns zero on success
+ */
+int ob_knode_resolve_at(struct knode *base, const char *path, int flags,
+    struct knode **res);
+
+/*
+ * Resolve a number of paths at once, directories shared
+ * by consecutive paths are only walked once. Slots of
+ * paths that failed to resolve are set to NULL, the rest
+ * hold a reference each.
+ *
+ * @base: Directory knode to start from (see ob_knode_resolve_at())
+ * @paths: Paths to resolve
+ * @count: Number of paths
+ * @flags: Optional flags
+ * @res: Result of each path is written here
+ *
+ * Returns zero if every path resolved, otherwise the
+ * error the first one to fail did.
+ */
+int ob_knode_resolve_batch(struct knode *base, const char **paths,
+    size_t count, int flags, struct knode **res);
+
 #endif  /* !_OB_KNODE_H_ */
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2025 Ian Marco Moffett and the OpenModality engineers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _OB_PCACHE_H_
+#define _OB_PCACHE_H_ 1
+
+#include <sys/types.h>
+#include <lib/stdbool.h>
+#include <ob/knode.h>
+
+/* Deepest path that may be cached */
+#define PCACHE_DEPTH 8
+
+/*
+ * Represents the directories a path walk went through
+ * along with their generations at the time, a cached
+ * result only holds while none of them has changed.
+ *
+ * @dirs: Directory knodes in walk order
+ * @gens: Generation of each directory
+ * @depth: Number of directories recorded
+ * @overflow: Set if the walk went too deep to cache
+ */
+struct pcache_trail {
+    struct knode *dirs[PCACHE_DEPTH];
+    uint32_t gens[PCACHE_DEPTH];
+    size_t depth;
+    bool overflow;
+};
+
+/*
+ * Record a directory a walk is about to search
+ *
+ * @trail: Trail of the walk
+ * @dir_kn: Directory knode being searched
+ */
+void ob_pcache_note(struct pcache_trail *trail, struct knode *dir_kn);
+
+/*
+ * Lookup the cached result of resolving a path, must
+ * be called from within a read side section (see
+ * ob/rcu.h).
+ *
+ * @path: Path that is being resolved
+ * @len: Length of 'path'
+ * @hash: Hash of 'path' (see ob_name_hash())
+ * @error: Cached error of a negative entry is written here
+ * @res: Cached knode of a positive entry is written here
+ *
+ * Returns true on a hit
+ */
+bool ob_pcache_lookup(const char *path, size_t len, uint32_t hash,
+    int *error, struct knode **res);
+
+/*
+ * Cache the result of resolving a path
+ *
+ * @path: Path that was resolved
+ * @len: Length of 'path'
+ * @hash: Hash of 'path' (see ob_name_hash())
+ * @trail: Directories the walk went through
+ * @error: Result of the walk
+ * @knp: Knode the path resolved to, NULL on failure
+ */
+void ob_pcache_enter(const char *path, size_t len, uint32_t hash,
+    struct pcache_trail *trail, int error, struct knode *knp);
+
+#endif  /* !_OB_PCACHE_H_ */
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2025 Ian Marco Moffett and the OpenModality engineers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _OB_RCU_H_
+#define _OB_RCU_H_ 1
+
+#include <sys/types.h>
+
+/*
+ * Enter an object store read side section, knodes
+ * reached from within it stay valid until the matching
+ * ob_rcu_exit() even if they are removed meanwhile.
+ * Sections may nest but must not block.
+ */
+void ob_rcu_enter(void);
+
+/*
+ * Leave an object store read side section
+ */
+void ob_rcu_exit(void);
+
+/*
+ * Wait until every read side section that was active
+ * on entry has been left, must not be called from
+ * within a read side section.
+ */
+void ob_rcu_synchronize(void);
+
+/*
+ * Run deferred callbacks that are already due, this
+ * never waits on readers.
+ */
+void ob_rcu_poll(void);
+
+/*
+ * Invoke a callback once every read side section that
+ * may still see its argument has been left. Callbacks
+ * run without locks held and may retire more objects.
+ *
+ * @fn: Callback to invoke
+ * @arg: Argument to pass to 'fn'
+ */
+void ob_rcu_call(void (*fn)(void *arg), void *arg);
+
+/*
+ * Free a pool allocation once every read side section
+ * that may still see it has been left.
+ *
+ * @ptr: Allocation to free
+ */
+void ob_rcu_defer(void *ptr);
+
+#endif  /* !_OB_RCU_H_ */
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2025 Ian Marco Moffett and the OpenModality engineers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _OB_SECTION_H_
+#define _OB_SECTION_H_ 1
+
+#include <sys/types.h>
+#include <ob/knode.h>
+#include <mu/pmap.h>
+
+#define KNODE_SECTION(KNODE_P) ((struct ksection *)(KNODE_P)->data)
+
+/*
+ * Represents a section of memory that may be mapped
+ * into any number of address spaces at once. Every
+ * frame holds one reference for the section and one
+ * for each page table entry mapping it, each mapping
+ * region holds a reference on the section knode.
+ *
+ * @length: Length of the section in bytes
+ * @npages: Number of frames within the section
+ * @frames: Physical address of each frame
+ */
+struct ksection {
+    size_t length;
+    size_t npages;
+    uintptr_t *frames;
+};
+
+/*
+ * Create a new zero-filled section
+ *
+ * @name: Name of section knode
+ * @length: Length of section in bytes
+ * @res: Section knode is written here
+ *
+ * Returns zero on success
+ */
+int ob_section_new(const char *name, size_t length, struct knode **res);
+
+/*
+ * Map a section into a virtual address space
+ *
+ * @knp: Section knode to map
+ * @vas: Virtual address space to map within
+ * @addr: Address hint, or the exact address with MAP_FIXED
+ * @off: Page aligned offset into the section
+ * @length: Length to map
+ * @prot: PROT_* protection flags
+ * @flags: MAP_SHARED or MAP_PRIVATE, optionally MAP_FIXED
+ *         and MAP_POPULATE
+ * @res: Base of the mapping is written here
+ *
+ * The mapping is removed with vmem_munmap()
+ *
+ * Returns zero on success
+ */
+int ob_section_map(
+    struct knode *knp, struct mu_vas *vas, uintptr_t addr,
+    size_t off, size_t length, int prot, int flags,
+    uintptr_t *res
+);
+
+/*
+ * Drop the reference on a section taken by its creator,
+ * the section is freed along with its knode once every
+ * mapping of it is gone. Sections appended to a directory
+ * hand that reference over to it instead.
+ *
+ * @knp: Section knode to release
+ */
+void ob_section_release(struct knode *knp);
+
+/*
+ * Free the frames backing a section, the K_SECTION
+ * destructor.
+ *
+ * @knp: Section knode to destroy
+ */
+void ob_section_destroy(struct knode *knp);
+
+#endif  /* !_OB_SECTION_H_ */
@@ -0,0 +1,585 @@
+/*
+ * Copyright (c) 2025 Ian Marco Moffett and the OpenModality engineers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/errno.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/units.h>
+#include <sys/mman.h>
+#include <mm/kva.h>
+#include <mm/pmem.h>
+#include <mm/memvar.h>
+#include <mu/pmap.h>
+#include <mu/cpu.h>
+#include <os/pool.h>
+#include <core/panic.h>
+#include <core/trace.h>
+#include <lib/string.h>
+
+#define dtrace(fmt, ...) printf("kva: " fmt, ##__VA_ARGS__)
+
+/* Refill or drain a quantum cache by this many */
+#define KVA_QCACHE_BATCH (KVA_QCACHE_DEPTH / 2)
+
+/* Pages translated at once when unmapping */
+#define KVA_XLATE_BATCH 32
+
+static struct kva_arena kernel_arena;
+static struct mu_vas kernel_vas;
+
+/*
+ * Returns the freelist a segment of 'size' bytes
+ * lives on, that is floor(log2(size)).
+ */
+static inline size_t
+kva_flist_index(size_t size)
+{
+    return (sizeof(size) * 8 - 1) - __builtin_clzl(size);
+}
+
+static inline size_t
+kva_hash_index(struct kva_arena *ap, uintptr_t base)
+{
+    return (base / ap->quantum) % KVA_NHASH;
+}
+
+static inline void
+kva_flist_insert(struct kva_arena *ap, struct kva_seg *seg)
+{
+    size_t index;
+
+    index = kva_flist_index(seg->size);
+    seg->free = true;
+    TAILQ_INSERT_HEAD(&ap->freelist[index], seg, link);
+}
+
+static inline void
+kva_flist_remove(struct kva_arena *ap, struct kva_seg *seg)
+{
+    size_t index;
+
+    index = kva_flist_index(seg->size);
+    TAILQ_REMOVE(&ap->freelist[index], seg, link);
+}
+
+/*
+ * Find a free segment of at least 'size' bytes, the
+ * arena must be locked.
+ */
+static struct kva_seg *
+kva_find_free(struct kva_arena *ap, size_t size, int flags)
+{
+    struct kva_seg *seg, *best = NULL;
+    size_t index, start;
+
+    index = kva_flist_index(size);
+
+    /*
+     * Every segment on a list above the one 'size' rounds
+     * up to is large enough, take the first one we see.
+     * Only fall back to searching the list 'size' itself
+     * is on when none are left.
+     */
+    if (ISSET(flags, KVA_INSTANTFIT)) {
+        start = index;
+        if ((size & (size - 1)) != 0)
+            ++start;
+
+        for (size_t i = start; i < KVA_NFREELIST; ++i) {
+            if ((seg = TAILQ_FIRST(&ap->freelist[i])) != NULL)
+                return seg;
+        }
+
+        TAILQ_FOREACH(seg, &ap->freelist[index], link) {
+            if (seg->size >= size)
+                return seg;
+        }
+
+        return NULL;
+    }
+
+    /* Best fit, the smallest segment that fits */
+    for (size_t i = index; i < KVA_NFREELIST; ++i) {
+        TAILQ_FOREACH(seg, &ap->freelist[i], link) {
+            if (seg->size < size)
+                continue;
+            if (best == NULL || seg->size < best->size)
+                best = seg;
+        }
+
+        if (best != NULL) {
+            break;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Allocate from the segment lists directly, the
+ * quantum caches are not touched.
+ */
+static int
+kva_xalloc(struct kva_arena *ap, size_t size, int flags, uintptr_t *res)
+{
+    struct kva_seg *seg, *rest;
+    size_t index;
+
+    /* Allocated up front, we may need to split */
+    if ((rest = os_pool_allocate(sizeof(*rest))) == NULL) {
+        return -ENOMEM;
+    }
+
+    spinlock_acquire(&ap->lock, true);
+    if ((seg = kva_find_free(ap, size, flags)) == NULL) {
+        spinlock_release(&ap->lock);
+        os_pool_free(rest);
+        return -ENOMEM;
+    }
+
+    kva_flist_remove(ap, seg);
+    if (seg->size > size) {
+        rest->base = seg->base + size;
+        rest->size = seg->size - size;
+        TAILQ_INSERT_AFTER(&ap->segq, seg, rest, segq);
+        kva_flist_insert(ap, rest);
+        seg->size = size;
+        rest = NULL;
+    }
+
+    seg->free = false;
+    index = kva_hash_index(ap, seg->base);
+    TAILQ_INSERT_HEAD(&ap->hash[index], seg, link);
+    ap->inuse += size;
+    *res = seg->base;
+    spinlock_release(&ap->lock);
+
+    if (rest != NULL) {
+        os_pool_free(rest);
+    }
+
+    return 0;
+}
+
+/*
+ * Free directly to the segment lists, coalescing with
+ * free neighbours.
+ */
+static void
+kva_xfree(struct kva_arena *ap, uintptr_t base, size_t size)
+{
+    struct kva_seg *seg, *next, *prev;
+    struct kva_seg *dead[2] = { NULL, NULL };
+    size_t index;
+
+    spinlock_acquire(&ap->lock, true);
+    index = kva_hash_index(ap, base);
+    TAILQ_FOREACH(seg, &ap->hash[index], link) {
+        if (seg->base == base)
+            break;
+    }
+
+    if (seg == NULL || seg->size != size) {
+        panic("kva: %s: bad free of %p (size=%x)\n", ap->name, base, size);
+    }
+
+    TAILQ_REMOVE(&ap->hash[index], seg, link);
+    ap->inuse -= size;
+
+    /* Merge with the segment above us */
+    next = TAILQ_NEXT(seg, segq);
+    if (next != NULL && next->free && seg->base + seg->size == next->base) {
+        kva_flist_remove(ap, next);
+        TAILQ_REMOVE(&ap->segq, next, segq);
+        seg->size += next->size;
+        dead[0] = next;
+    }
+
+    /* Merge with the segment below us */
+    prev = TAILQ_PREV(seg, kva_seglist, segq);
+    if (prev != NULL && prev->free && prev->base + prev->size == seg->base) {
+        kva_flist_remove(ap, prev);
+        TAILQ_REMOVE(&ap->segq, seg, segq);
+        prev->size += seg->size;
+        dead[1] = seg;
+        seg = prev;
+    }
+
+    kva_flist_insert(ap, seg);
+    spinlock_release(&ap->lock);
+
+    for (size_t i = 0; i < 2; ++i) {
+        if (dead[i] != NULL)
+            os_pool_free(dead[i]);
+    }
+}
+
+/*
+ * Returns the quantum cache of the current processor
+ * for a given size.
+ */
+static inline struct kva_qcache *
+kva_qcache(struct kva_arena *ap, size_t size)
+{
+    struct pcr *self;
+    uint16_t id;
+
+    self = mu_cpu_self();
+    id = (self != NULL) ? self->id : 0;
+    return &ap->qcache[id][(size / ap->quantum) - 1];
+}
+
+int
+kva_arena_init(struct kva_arena *ap, const char *name, uintptr_t base,
+    size_t size, size_t quantum, size_t qcache_max)
+{
+    if (ap == NULL || quantum == 0) {
+        return -EINVAL;
+    }
+
+    if ((quantum & (quantum - 1)) != 0) {
+        return -EINVAL;
+    }
+
+    memset(ap, 0, sizeof(*ap));
+    ap->name = name;
+    ap->quantum = quantum;
+    ap->qcache_max = qcache_max;
+    if (qcache_max > quantum * KVA_QCACHE_MAX) {
+        ap->qcache_max = quantum * KVA_QCACHE_MAX;
+    }
+    TAILQ_INIT(&ap->segq);
+    for (size_t i = 0; i < KVA_NFREELIST; ++i) {
+        TAILQ_INIT(&ap->freelist[i]);
+    }
+
+    for (size_t i = 0; i < KVA_NHASH; ++i) {
+        TAILQ_INIT(&ap->hash[i]);
+    }
+
+    if (size == 0) {
+        return 0;
+    }
+
+    return kva_arena_add(ap, base, size);
+}
+
+int
+kva_arena_add(struct kva_arena *ap, uintptr_t base, size_t size)
+{
+    struct kva_seg *seg, *cur;
+
+    if (ap == NULL || size == 0) {
+        return -EINVAL;
+    }
+
+    if (ISSET(base | size, ap->quantum - 1)) {
+        return -EINVAL;
+    }
+
+    if ((seg = os_pool_allocate(sizeof(*seg))) == NULL) {
+        return -ENOMEM;
+    }
+
+    seg->base = base;
+    seg->size = size;
+
+    /* Keep the segment list ordered by address */
+    spinlock_acquire(&ap->lock, true);
+    TAILQ_FOREACH(cur, &ap->segq, segq) {
+        if (cur->base > base)
+            break;
+    }
+
+    if (cur == NULL) {
+        TAILQ_INSERT_TAIL(&ap->segq, seg, segq);
+    } else if ((cur = TAILQ_PREV(cur, kva_seglist, segq)) != NULL) {
+        TAILQ_INSERT_AFTER(&ap->segq, cur, seg, segq);
+    } else {
+        TAILQ_INSERT_HEAD(&ap->segq, seg, segq);
+    }
+
+    kva_flist_insert(ap, seg);
+    ap->total += size;
+    spinlock_release(&ap->lock);
+    return 0;
+}
+
+int
+kva_alloc(struct kva_arena *ap, size_t size, int flags, uintptr_t *res)
+{
+    struct kva_qcache *qc;
+    uintptr_t base;
+    int error = 0;
+
+    if (ap == NULL || res == NULL || size == 0) {
+        return -EINVAL;
+    }
+
+    if ((flags & (KVA_INSTANTFIT | KVA_BESTFIT)) == 0) {
+        flags |= KVA_INSTANTFIT;
+    }
+
+    size = ALIGN_UP(size, ap->quantum);
+    if (size > ap->qcache_max) {
+        return kva_xalloc(ap, size, flags, res);
+    }
+
+    /*
+     * Small sizes come from the quantum cache of this
+     * processor, refilled in batches when it runs dry so
+     * that the arena lock is rarely taken.
+     */
+    qc = kva_qcache(ap, size);
+    spinlock_acquire(&qc->lock, true);
+    while (qc->count < KVA_QCACHE_BATCH) {
+        error = kva_xalloc(ap, size, KVA_INSTANTFIT, &base);
+        if (error != 0)
+            break;
+
+        qc->slot[qc->count++] = base;
+    }
+
+    if (qc->count == 0) {
+        spinlock_release(&qc->lock);
+        return error;
+    }
+
+    *res = qc->slot[--qc->count];
+    spinlock_release(&qc->lock);
+    return 0;
+}
+
+void
+kva_free(struct kva_arena *ap, uintptr_t base, size_t size)
+{
+    struct kva_qcache *qc;
+
+    if (ap == NULL || size == 0) {
+        return;
+    }
+
+    size = ALIGN_UP(size, ap->quantum);
+    if (size > ap->qcache_max) {
+        kva_xfree(ap, base, size);
+        return;
+    }
+
+    /* Drain half of a full cache back to the arena */
+    qc = kva_qcache(ap, size);
+    spinlock_acquire(&qc->lock, true);
+    if (qc->count == KVA_QCACHE_DEPTH) {
+        while (qc->count > KVA_QCACHE_BATCH) {
+            kva_xfree(ap, qc->slot[--qc->count], size);
+        }
+    }
+
+    qc->slot[qc->count++] = base;
+    spinlock_release(&qc->lock);
+}
+
+/*
+ * Unmap a range of kernel memory, releasing the frames
+ * that back it if 'release' is set.
+ */
+static void
+kva_unmap(uintptr_t va, size_t length, bool release)
+{
+    struct pmap_gather pg;
+    uintptr_t pa[KVA_XLATE_BATCH];
+    size_t npages, count, off = 0;
+
+    mu_pmap_gather_init(&pg, &kernel_vas);
+    while (off < length) {
+        npages = (length - off) / PAGESIZE;
+        if (npages > KVA_XLATE_BATCH) {
+            npages = KVA_XLATE_BATCH;
+        }
+
+        count = mu_pmap_translate_range(&kernel_vas, va + off, npages, pa);
+        for (size_t i = 0; i < count; ++i) {
+            mu_pmap_remove(&pg, va + off + (i * PAGESIZE), PAGESIZE_4K);
+            if (release) {
+                mm_pmem_unref(pa[i]);
+            }
+        }
+
+        /* Step over the hole that ended the run */
+        if (count < npages) {
+            ++count;
+        }
+
+        off += count * PAGESIZE;
+    }
+
+    mu_pmap_gather_flush(&pg);
+}
+
+void *
+mm_vmalloc(size_t length)
+{
+    struct pmap_gather pg;
+    uintptr_t va, pa;
+    size_t off;
+    int error;
+
+    if (length == 0) {
+        return NULL;
+    }
+
+    length = ALIGN_UP(length, PAGESIZE);
+    if (kva_alloc(&kernel_arena, length, KVA_INSTANTFIT, &va) != 0) {
+        return NULL;
+    }
+
+    /*
+     * Back the range one frame at a time, they do not need
+     * to be contiguous as we are not going through the
+     * direct map.
+     */
+    mu_pmap_gather_init(&pg, &kernel_vas);
+    for (off = 0; off < length; off += PAGESIZE) {
+        if ((pa = mm_pmem_alloc(1)) == 0) {
+            break;
+        }
+
+        error = mu_pmap_enter(
+            &pg,
+            va + off,
+            pa,
+            PROT_READ | PROT_WRITE,
+            PAGESIZE_4K
+        );
+
+        if (error != 0) {
+            mm_pmem_free(pa, 1);
+            break;
+        }
+    }
+
+    mu_pmap_gather_flush(&pg);
+    if (off < length) {
+        kva_unmap(va, off, true);
+        kva_free(&kernel_arena, va, length);
+        return NULL;
+    }
+
+    return (void *)va;
+}
+
+void
+mm_vfree(void *ptr, size_t length)
+{
+    uintptr_t va = (uintptr_t)ptr;
+
+    if (ptr == NULL || length == 0) {
+        return;
+    }
+
+    /* Addresses may only be reused once unmapped everywhere */
+    length = ALIGN_UP(length, PAGESIZE);
+    kva_unmap(va, length, true);
+    kva_free(&kernel_arena, va, length);
+}
+
+void *
+mm_vmap_phys(uintptr_t pa, size_t length, int prot)
+{
+    struct pmap_gather pg;
+    uintptr_t va;
+    size_t off, misalign;
+    int error = 0;
+
+    if (length == 0) {
+        return NULL;
+    }
+
+    misalign = pa & (PAGESIZE - 1);
+    pa -= misalign;
+    length = ALIGN_UP(length + misalign, PAGESIZE);
+    if (kva_alloc(&kernel_arena, length, KVA_INSTANTFIT, &va) != 0) {
+        return NULL;
+    }
+
+    mu_pmap_gather_init(&pg, &kernel_vas);
+    for (off = 0; off < length; off += PAGESIZE) {
+        error = mu_pmap_enter(&pg, va + off, pa + off, prot, PAGESIZE_4K);
+        if (error != 0) {
+            break;
+        }
+    }
+
+    mu_pmap_gather_flush(&pg);
+    if (error != 0) {
+        kva_unmap(va, off, false);
+        kva_free(&kernel_arena, va, length);
+        return NULL;
+    }
+
+    return PTR_OFFSET(va, misalign);
+}
+
+void
+mm_vunmap_phys(void *ptr, size_t length)
+{
+    uintptr_t va = (uintptr_t)ptr;
+    size_t misalign;
+
+    if (ptr == NULL || length == 0) {
+        return;
+    }
+
+    misalign = va & (PAGESIZE - 1);
+    va -= misalign;
+    length = ALIGN_UP(length + misalign, PAGESIZE);
+    kva_unmap(va, length, false);
+    kva_free(&kernel_arena, va, length);
+}
+
+void
+mm_kva_init(void)
+{
+    int error;
+
+    mu_pmap_readvas(&kernel_vas);
+    error = kva_arena_init(
+        &kernel_arena,
+        "kernel",
+        MD_KVA_BASE,
+        MD_KVA_SIZE,
+        PAGESIZE,
+        PAGESIZE * KVA_QCACHE_MAX
+    );
+
+    if (error != 0) {
+        panic("kva: could not initialize kernel arena\n");
+    }
+
+    dtrace("arena at %p (%d GiB)\n", MD_KVA_BASE, MD_KVA_SIZE / UNIT_GIB);
+}
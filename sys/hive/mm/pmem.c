@@ -40,6 +40,9 @@
 
 #define dtrace(fmt, ...) printf("pmem: " fmt, ##__VA_ARGS__)
 
+/* Share counts saturate here and the frame is never freed */
+#define PMEM_REF_MAX 0xFFFF
+
 /* Various stats */
 static uintptr_t usable_top = 0;
 static size_t mem_usable = 0;
@@ -47,9 +50,14 @@ static size_t mem_usable = 0;
 /* Bitmap */
 static size_t bitmap_size = 0;
 static uint8_t *bitmap = NULL;
+static uintptr_t bitmap_phys = 0;
 static size_t last_bit = 0;
 static spinlock_t bitmap_lock = 0;
 
+/* Per-frame share counts, follows the bitmap */
+static size_t frame_count = 0;
+static uint16_t *frame_refs = NULL;
+
 /*
  * Display size values in a pretty format
  */
@@ -87,6 +95,19 @@ bitmap_set_range(uintptr_t start, uintptr_t end, bool alloc)
     }
 }
 
+/*
+ * Returns the number of bytes used by the bitmap
+ * and share counts combined.
+ */
+static inline size_t
+pmem_meta_size(void)
+{
+    size_t size;
+
+    size = bitmap_size + (frame_count * sizeof(*frame_refs));
+    return ALIGN_UP(size, PAGESIZE);
+}
+
 /*
  * Fill the bitmap based on the system memory
  * map
@@ -98,6 +119,7 @@ pmem_fill_bitmap(void)
     uintptr_t start, end;
 
     memset(bitmap, 0xFF, bitmap_size);
+    memset(frame_refs, 0, frame_count * sizeof(*frame_refs));
     for (size_t i = 0;; ++i) {
         if (bpt_get_mementry(i, &entry) != 0) {
             break;
@@ -109,6 +131,10 @@ pmem_fill_bitmap(void)
             bitmap_set_range(start, end, false);
         }
     }
+
+    /* Don't hand out the frames we live in */
+    start = bitmap_phys;
+    bitmap_set_range(start, start + pmem_meta_size(), true);
 }
 
 /*
@@ -119,6 +145,7 @@ static void
 pmem_alloc_bitmap(void)
 {
     struct bpt_mementry entry;
+    uintptr_t base;
 
     for (size_t i = 0;; ++i) {
         if (bpt_get_mementry(i, &entry) != 0) {
@@ -131,11 +158,14 @@ pmem_alloc_bitmap(void)
         }
 
         /* Drop entries that are too small */
-        if (entry.length < bitmap_size) {
+        base = ALIGN_UP(entry.base, PAGESIZE);
+        if (entry.base + entry.length < base + pmem_meta_size()) {
             continue;
         }
 
-        bitmap = PHYS_TO_VIRT(entry.base);
+        bitmap_phys = base;
+        bitmap = PHYS_TO_VIRT(base);
+        frame_refs = PTR_OFFSET(bitmap, bitmap_size);
         break;
     }
 
@@ -166,9 +196,14 @@ pmem_probe(void)
         }
     }
 
-    /* Compute the length of the bitmap */
-    bitmap_size = mem_usable / PAGESIZE;
-    bitmap_size = ALIGN_UP(bitmap_size, CHAR_BIT) / CHAR_BIT;
+    /*
+     * Compute the length of the bitmap, it is indexed by
+     * frame number so it must cover every frame up to the
+     * usable top, holes included.
+     */
+    frame_count = usable_top / PAGESIZE;
+    bitmap_size = ALIGN_UP(frame_count, CHAR_BIT) / CHAR_BIT;
+    bitmap_size = ALIGN_UP(bitmap_size, sizeof(*frame_refs));
 
     /* Print stats */
     pmem_print_size("usable", mem_usable);
@@ -176,10 +211,11 @@ pmem_probe(void)
 }
 
 /*
- * Allocate one or more physical memory frames
+ * Allocate one or more physical memory frames, the first
+ * frame index being a multiple of 'align'.
  */
 static uintptr_t
-pmem_alloc(size_t count)
+pmem_alloc(size_t count, size_t align)
 {
     ssize_t start_idx = -1;
     size_t frames_found = 0;
@@ -189,8 +225,12 @@ pmem_alloc(size_t count)
     max_bit = usable_top / PAGESIZE;
     for (size_t i = last_bit; i < max_bit; ++i) {
         if (!TESTBIT(bitmap, i)) {
-            if (start_idx < 0)
+            if (start_idx < 0) {
+                if ((i & (align - 1)) != 0)
+                    continue;
                 start_idx = i;
+            }
+
             if ((++frames_found) >= count)
                 break;
 
@@ -198,34 +238,54 @@ pmem_alloc(size_t count)
         }
 
         start_idx = -1;
+        frames_found = 0;
     }
 
-    if (start_idx < 0) {
+    if (start_idx < 0 || frames_found < count) {
         return 0;
     }
 
     start = start_idx * PAGESIZE;
     end = start + (count * PAGESIZE);
     bitmap_set_range(start, end, true);
+    for (size_t i = 0; i < count; ++i) {
+        frame_refs[start_idx + i] = 1;
+    }
+
     return start;
 }
 
 uintptr_t
-mm_pmem_alloc(size_t count)
+mm_pmem_alloc_align(size_t count, size_t align)
 {
     uintptr_t phys;
 
+    if (count == 0 || align < PAGESIZE) {
+        return 0;
+    }
+
+    if ((align & (align - 1)) != 0) {
+        return 0;
+    }
+
+    align /= PAGESIZE;
     spinlock_acquire(&bitmap_lock, true);
-    phys = pmem_alloc(count);
+    phys = pmem_alloc(count, align);
     if (phys == 0) {
         last_bit = 0;
-        phys = pmem_alloc(count);
+        phys = pmem_alloc(count, align);
     }
 
     spinlock_release(&bitmap_lock);
     return phys;
 }
 
+uintptr_t
+mm_pmem_alloc(size_t count)
+{
+    return mm_pmem_alloc_align(count, PAGESIZE);
+}
+
 void
 mm_pmem_free(uintptr_t base, size_t count)
 {
@@ -234,6 +294,84 @@ mm_pmem_free(uintptr_t base, size_t count)
     spinlock_acquire(&bitmap_lock, true);
     range_end = base + (count * PAGESIZE);
     bitmap_set_range(base, range_end, false);
+    for (uintptr_t p = base; p < range_end; p += PAGESIZE) {
+        if ((p / PAGESIZE) < frame_count)
+            frame_refs[p / PAGESIZE] = 0;
+    }
+
+    spinlock_release(&bitmap_lock);
+}
+
+void
+mm_pmem_ref(uintptr_t pa)
+{
+    size_t frame = pa / PAGESIZE;
+
+    if (frame >= frame_count) {
+        return;
+    }
+
+    spinlock_acquire(&bitmap_lock, true);
+    if (frame_refs[frame] < PMEM_REF_MAX) {
+        ++frame_refs[frame];
+    }
+    spinlock_release(&bitmap_lock);
+}
+
+size_t
+mm_pmem_unref(uintptr_t pa)
+{
+    size_t frame = pa / PAGESIZE;
+    size_t refs;
+
+    if (frame >= frame_count) {
+        return 0;
+    }
+
+    spinlock_acquire(&bitmap_lock, true);
+    refs = frame_refs[frame];
+    if (refs == 0 || refs == PMEM_REF_MAX) {
+        spinlock_release(&bitmap_lock);
+        return refs;
+    }
+
+    /* Last reference gone, release the frame */
+    frame_refs[frame] = --refs;
+    if (refs == 0) {
+        CLRBIT(bitmap, frame);
+    }
+
+    spinlock_release(&bitmap_lock);
+    return refs;
+}
+
+size_t
+mm_pmem_refcount(uintptr_t pa)
+{
+    size_t frame = pa / PAGESIZE;
+    size_t refs;
+
+    if (frame >= frame_count) {
+        return 0;
+    }
+
+    spinlock_acquire(&bitmap_lock, true);
+    refs = frame_refs[frame];
+    spinlock_release(&bitmap_lock);
+    return refs;
+}
+
+void
+mm_pmem_pin(uintptr_t base, size_t count)
+{
+    size_t frame = base / PAGESIZE;
+
+    spinlock_acquire(&bitmap_lock, true);
+    for (size_t i = 0; i < count && frame + i < frame_count; ++i) {
+        SETBIT(bitmap, frame + i);
+        frame_refs[frame + i] = PMEM_REF_MAX;
+    }
+
     spinlock_release(&bitmap_lock);
 }
 
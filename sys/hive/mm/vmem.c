@@ -32,13 +32,24 @@
 #include <sys/param.h>
 #include <mm/vmem.h>
 #include <mm/memvar.h>
+#include <sys/atomic.h>
+#include <sys/units.h>
+#include <sys/mman.h>
+#include <mm/pmem.h>
+#include <mu/cpu.h>
+#include <os/pool.h>
+#include <lib/string.h>
+
+/* Size of a huge page */
+#define HUGE_PAGESIZE (UNIT_MIB * 2)
 
 int
 vmem_map_region(struct mu_vas *vas, struct vmem_region *region, int prot)
 {
+    struct pmap_gather pg;
     uintptr_t pbase, vbase;
     size_t length;
-    int error;
+    int error = 0;
 
     if (vas == NULL || region == NULL) {
         return -EINVAL;
@@ -49,9 +60,10 @@ vmem_map_region(struct mu_vas *vas, struct vmem_region *region, int prot)
     vbase = ALIGN_DOWN(region->vma, PAGESIZE);
     length = ALIGN_UP(region->length, PAGESIZE);
 
+    mu_pmap_gather_init(&pg, vas);
     for (off_t i = 0; i < length; i += PAGESIZE) {
-        error = mu_pmap_map(
-            vas,
+        error = mu_pmap_enter(
+            &pg,
             vbase + i,
             pbase + i,
             prot,
@@ -60,9 +72,1250 @@ vmem_map_region(struct mu_vas *vas, struct vmem_region *region, int prot)
 
         /* TODO: We'll need to clean up after ourselves here */
         if (error != 0) {
+            break;
+        }
+    }
+
+    mu_pmap_gather_flush(&pg);
+    return error;
+}
+
+int
+vmem_unmap_region(struct mu_vas *vas, struct vmem_region *region)
+{
+    struct pmap_gather pg;
+    uintptr_t vbase;
+    size_t length;
+    int error = 0;
+
+    if (vas == NULL || region == NULL) {
+        return -EINVAL;
+    }
+
+    vbase = ALIGN_DOWN(region->vma, PAGESIZE);
+    length = ALIGN_UP(region->length, PAGESIZE);
+
+    mu_pmap_gather_init(&pg, vas);
+    for (off_t i = 0; i < length; i += PAGESIZE) {
+        error = mu_pmap_remove(&pg, vbase + i, PAGESIZE_4K);
+        if (error != 0) {
+            break;
+        }
+    }
+
+    mu_pmap_gather_flush(&pg);
+    return error;
+}
+
+int
+vmem_protect_region(struct mu_vas *vas, struct vmem_region *region, int prot)
+{
+    struct pmap_gather pg;
+    uintptr_t vbase;
+    size_t length;
+    int error = 0;
+
+    if (vas == NULL || region == NULL) {
+        return -EINVAL;
+    }
+
+    vbase = ALIGN_DOWN(region->vma, PAGESIZE);
+    length = ALIGN_UP(region->length, PAGESIZE);
+
+    mu_pmap_gather_init(&pg, vas);
+    for (off_t i = 0; i < length; i += PAGESIZE) {
+        error = mu_pmap_protect(&pg, vbase + i, prot, PAGESIZE_4K);
+        if (error != 0) {
+            break;
+        }
+    }
+
+    mu_pmap_gather_flush(&pg);
+    return error;
+}
+
+/*
+ * Per-processor cache of the last region a lookup hit,
+ * only valid while the generation of the map matches.
+ *
+ * @map: Map the region belongs to
+ * @region: Region that was hit
+ * @gen: Generation of the map at the time
+ */
+struct vmem_hint {
+    struct vmem_map *map;
+    struct vmem_region *region;
+    unsigned long gen;
+};
+
+static struct vmem_hint hint_cache[CPU_MAX];
+static volatile unsigned long map_gen = 0;
+
+static inline size_t
+vmem_max(size_t a, size_t b)
+{
+    return (a > b) ? a : b;
+}
+
+static inline int
+vmem_height(struct vmem_region *rp)
+{
+    return (rp != NULL) ? rp->height : 0;
+}
+
+/*
+ * Recompute the cached subtree values of a region
+ * from those of its children.
+ */
+static void
+vmem_update(struct vmem_region *rp)
+{
+    struct vmem_region *l = rp->left, *r = rp->right;
+    uintptr_t end = rp->vma + rp->length;
+    size_t gap = 0;
+
+    rp->height = vmem_max(vmem_height(l), vmem_height(r)) + 1;
+    rp->min_va = (l != NULL) ? l->min_va : rp->vma;
+    rp->max_end = (r != NULL) ? r->max_end : end;
+
+    if (l != NULL) {
+        gap = vmem_max(l->max_gap, rp->vma - l->max_end);
+    }
+
+    if (r != NULL) {
+        gap = vmem_max(gap, r->max_gap);
+        gap = vmem_max(gap, r->min_va - end);
+    }
+
+    rp->max_gap = gap;
+}
+
+static struct vmem_region *
+vmem_rotate_left(struct vmem_region *rp)
+{
+    struct vmem_region *r = rp->right;
+
+    rp->right = r->left;
+    r->left = rp;
+    vmem_update(rp);
+    vmem_update(r);
+    return r;
+}
+
+static struct vmem_region *
+vmem_rotate_right(struct vmem_region *rp)
+{
+    struct vmem_region *l = rp->left;
+
+    rp->left = l->right;
+    l->right = rp;
+    vmem_update(rp);
+    vmem_update(l);
+    return l;
+}
+
+/*
+ * Restore the balance of a subtree after one of its
+ * children changed, returns the new subtree root.
+ */
+static struct vmem_region *
+vmem_balance(struct vmem_region *rp)
+{
+    int bf;
+
+    vmem_update(rp);
+    bf = vmem_height(rp->left) - vmem_height(rp->right);
+    if (bf > 1) {
+        if (vmem_height(rp->left->left) < vmem_height(rp->left->right))
+            rp->left = vmem_rotate_left(rp->left);
+        return vmem_rotate_right(rp);
+    }
+
+    if (bf < -1) {
+        if (vmem_height(rp->right->right) < vmem_height(rp->right->left))
+            rp->right = vmem_rotate_right(rp->right);
+        return vmem_rotate_left(rp);
+    }
+
+    return rp;
+}
+
+static struct vmem_region *
+vmem_tree_insert(struct vmem_region *root, struct vmem_region *rp)
+{
+    if (root == NULL) {
+        rp->left = NULL;
+        rp->right = NULL;
+        vmem_update(rp);
+        return rp;
+    }
+
+    if (rp->vma < root->vma) {
+        root->left = vmem_tree_insert(root->left, rp);
+    } else {
+        root->right = vmem_tree_insert(root->right, rp);
+    }
+
+    return vmem_balance(root);
+}
+
+static struct vmem_region *
+vmem_tree_remove_min(struct vmem_region *root, struct vmem_region **min)
+{
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = vmem_tree_remove_min(root->left, min);
+    return vmem_balance(root);
+}
+
+static struct vmem_region *
+vmem_tree_remove(struct vmem_region *root, struct vmem_region *rp)
+{
+    struct vmem_region *min;
+
+    if (root == NULL) {
+        return NULL;
+    }
+
+    if (rp->vma < root->vma) {
+        root->left = vmem_tree_remove(root->left, rp);
+    } else if (rp->vma > root->vma) {
+        root->right = vmem_tree_remove(root->right, rp);
+    } else {
+        if (root->right == NULL) {
+            return root->left;
+        }
+
+        /* Replace it with its successor */
+        root->right = vmem_tree_remove_min(root->right, &min);
+        min->left = root->left;
+        min->right = root->right;
+        root = min;
+    }
+
+    return vmem_balance(root);
+}
+
+/*
+ * Returns a region overlapping [va, end) if there
+ * is one.
+ */
+static struct vmem_region *
+vmem_tree_overlap(struct vmem_region *rp, uintptr_t va, uintptr_t end)
+{
+    while (rp != NULL) {
+        if (end <= rp->vma) {
+            rp = rp->left;
+        } else if (va >= rp->vma + rp->length) {
+            rp = rp->right;
+        } else {
+            return rp;
+        }
+    }
+
+    return NULL;
+}
+
+static struct vmem_region *
+vmem_tree_first(struct vmem_region *rp)
+{
+    while (rp != NULL && rp->left != NULL) {
+        rp = rp->left;
+    }
+
+    return rp;
+}
+
+/*
+ * Returns the first region with a virtual base
+ * above 'va'.
+ */
+static struct vmem_region *
+vmem_tree_next(struct vmem_region *rp, uintptr_t va)
+{
+    struct vmem_region *next = NULL;
+
+    while (rp != NULL) {
+        if (rp->vma > va) {
+            next = rp;
+            rp = rp->left;
+        } else {
+            rp = rp->right;
+        }
+    }
+
+    return next;
+}
+
+/*
+ * Try to fit 'length' bytes into the gap [start, end)
+ * clipped to [lo, hi).
+ */
+static bool
+vmem_gap_fit(uintptr_t start, uintptr_t end, size_t length, size_t align,
+    uintptr_t lo, uintptr_t hi, uintptr_t *res)
+{
+    if (start < lo)
+        start = lo;
+    if (end > hi)
+        end = hi;
+
+    start = ALIGN_UP(start, align);
+    if (start >= end || (end - start) < length) {
+        return false;
+    }
+
+    *res = start;
+    return true;
+}
+
+/*
+ * Search the gaps between the regions of a subtree in
+ * ascending order, subtrees whose largest gap is too
+ * small are skipped entirely.
+ */
+static bool
+vmem_gap_search(struct vmem_region *rp, size_t length, size_t align,
+    uintptr_t lo, uintptr_t hi, uintptr_t *res)
+{
+    struct vmem_region *l, *r;
+
+    if (rp == NULL || rp->max_gap < length) {
+        return false;
+    }
+
+    if (rp->max_end <= lo || rp->min_va >= hi) {
+        return false;
+    }
+
+    l = rp->left;
+    r = rp->right;
+    if (l != NULL) {
+        if (vmem_gap_search(l, length, align, lo, hi, res))
+            return true;
+        if (vmem_gap_fit(l->max_end, rp->vma, length, align, lo, hi, res))
+            return true;
+    }
+
+    if (r != NULL) {
+        if (vmem_gap_fit(rp->vma + rp->length, r->min_va, length, align,
+            lo, hi, res))
+            return true;
+        if (vmem_gap_search(r, length, align, lo, hi, res))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Mark a map as changed, this invalidates every
+ * cached lookup hint referencing it.
+ */
+static inline void
+vmem_map_touch(struct vmem_map *map)
+{
+    map->gen = atomic_inc_long(&map_gen);
+}
+
+/*
+ * Acquire the region map of a virtual address space,
+ * allocating it if needed.
+ */
+static struct vmem_map *
+vmem_get_map(struct mu_vas *vas)
+{
+    struct vmem_map *map;
+
+    if ((map = vas->map) != NULL) {
+        return map;
+    }
+
+    map = os_pool_allocate(sizeof(*map));
+    if (map == NULL) {
+        return NULL;
+    }
+
+    map->root = NULL;
+    map->nregions = 0;
+    map->lock = 0;
+    vmem_map_touch(map);
+    vas->map = map;
+    return map;
+}
+
+/*
+ * Lookup the region containing 'va', the map
+ * must be locked.
+ */
+static struct vmem_region *
+vmem_map_lookup(struct vmem_map *map, uintptr_t va)
+{
+    struct vmem_region *rp;
+    struct vmem_hint *hint;
+    struct pcr *self;
+
+    /* Faults tend to hit the same region over and over */
+    self = mu_cpu_self();
+    hint = &hint_cache[(self != NULL) ? self->id : 0];
+    if (hint->map == map && hint->gen == map->gen) {
+        rp = hint->region;
+        if (va >= rp->vma && va < rp->vma + rp->length) {
+            return rp;
+        }
+    }
+
+    rp = vmem_tree_overlap(map->root, va, va + 1);
+    if (rp != NULL) {
+        hint->map = map;
+        hint->region = rp;
+        hint->gen = map->gen;
+    }
+
+    return rp;
+}
+
+/*
+ * Insert a region into a map, the map must be
+ * locked.
+ */
+static int
+vmem_map_insert(struct vmem_map *map, struct vmem_region *rp)
+{
+    uintptr_t end;
+
+    end = rp->vma + rp->length;
+    if (vmem_tree_overlap(map->root, rp->vma, end) != NULL) {
+        return -EEXIST;
+    }
+
+    map->root = vmem_tree_insert(map->root, rp);
+    ++map->nregions;
+    vmem_map_touch(map);
+    return 0;
+}
+
+/*
+ * Take a reference on the object backing a region
+ * if there is one.
+ */
+static inline void
+vmem_region_ref(struct vmem_region *rp)
+{
+    if (rp->backing == VMEM_OBJECT) {
+        rp->pager->ref(rp->object);
+    }
+}
+
+/*
+ * Free a region descriptor along with its reference
+ * on the backing object.
+ */
+static void
+vmem_region_free(struct vmem_region *rp)
+{
+    if (rp->backing == VMEM_OBJECT) {
+        rp->pager->unref(rp->object);
+    }
+
+    os_pool_free(rp);
+}
+
+int
+vmem_region_add(struct mu_vas *vas, struct vmem_region *region)
+{
+    struct vmem_map *map;
+    struct vmem_region *rp;
+    int error;
+
+    if (vas == NULL || region == NULL) {
+        return -EINVAL;
+    }
+
+    if (region->length == 0) {
+        return -EINVAL;
+    }
+
+    if (ISSET(region->vma | region->length, PAGESIZE - 1)) {
+        return -EINVAL;
+    }
+
+    if ((map = vmem_get_map(vas)) == NULL) {
+        return -ENOMEM;
+    }
+
+    if ((rp = os_pool_allocate(sizeof(*rp))) == NULL) {
+        return -ENOMEM;
+    }
+
+    *rp = *region;
+    if (rp->backing != VMEM_OBJECT) {
+        rp->pager = NULL;
+        rp->object = NULL;
+    } else if (rp->pager == NULL || rp->object == NULL) {
+        os_pool_free(rp);
+        return -EINVAL;
+    }
+
+    spinlock_acquire(&map->lock, true);
+    error = vmem_map_insert(map, rp);
+    spinlock_release(&map->lock);
+
+    if (error != 0) {
+        os_pool_free(rp);
+        return error;
+    }
+
+    vmem_region_ref(rp);
+    return 0;
+}
+
+int
+vmem_region_del(struct mu_vas *vas, uintptr_t va)
+{
+    struct vmem_map *map;
+    struct vmem_region *rp;
+
+    if (vas == NULL || (map = vas->map) == NULL) {
+        return -EINVAL;
+    }
+
+    spinlock_acquire(&map->lock, true);
+    if ((rp = vmem_tree_overlap(map->root, va, va + 1)) == NULL) {
+        spinlock_release(&map->lock);
+        return -ENOENT;
+    }
+
+    map->root = vmem_tree_remove(map->root, rp);
+    --map->nregions;
+    vmem_map_touch(map);
+    spinlock_release(&map->lock);
+
+    vmem_region_free(rp);
+    return 0;
+}
+
+struct vmem_region *
+vmem_region_find(struct mu_vas *vas, uintptr_t va)
+{
+    struct vmem_map *map;
+    struct vmem_region *rp;
+
+    if (vas == NULL || (map = vas->map) == NULL) {
+        return NULL;
+    }
+
+    spinlock_acquire(&map->lock, true);
+    rp = vmem_map_lookup(map, va);
+    spinlock_release(&map->lock);
+    return rp;
+}
+
+int
+vmem_find_gap(struct mu_vas *vas, size_t length, size_t align, uintptr_t lo,
+    uintptr_t hi, uintptr_t *res)
+{
+    struct vmem_map *map;
+    struct vmem_region *root;
+    bool found;
+
+    if (vas == NULL || res == NULL || length == 0) {
+        return -EINVAL;
+    }
+
+    if (align < PAGESIZE || (align & (align - 1)) != 0) {
+        return -EINVAL;
+    }
+
+    length = ALIGN_UP(length, PAGESIZE);
+    if ((map = vas->map) == NULL) {
+        found = vmem_gap_fit(lo, hi, length, align, lo, hi, res);
+        return found ? 0 : -ENOMEM;
+    }
+
+    spinlock_acquire(&map->lock, true);
+    if ((root = map->root) == NULL) {
+        found = vmem_gap_fit(lo, hi, length, align, lo, hi, res);
+    } else {
+        found = vmem_gap_fit(lo, root->min_va, length, align, lo, hi, res) ||
+            vmem_gap_search(root, length, align, lo, hi, res) ||
+            vmem_gap_fit(root->max_end, hi, length, align, lo, hi, res);
+    }
+
+    spinlock_release(&map->lock);
+    return found ? 0 : -ENOMEM;
+}
+
+int
+vmem_reserve(struct mu_vas *vas, uintptr_t va, size_t length, int prot)
+{
+    struct vmem_region region;
+
+    region.vma = va;
+    region.pma = 0;
+    region.length = length;
+    region.prot = prot;
+    region.backing = VMEM_ANON;
+    region.flags = 0;
+    return vmem_region_add(vas, &region);
+}
+
+/*
+ * Returns true if the 'prot' protection flags allow
+ * the access described by the 'fault' flags.
+ */
+static inline bool
+vmem_fault_allowed(int prot, int fault)
+{
+    if (ISSET(fault, VMEM_FAULT_WRITE) && !ISSET(prot, PROT_WRITE))
+        return false;
+    if (ISSET(fault, VMEM_FAULT_EXEC) && !ISSET(prot, PROT_EXEC))
+        return false;
+    if (ISSET(fault, VMEM_FAULT_USER) && !ISSET(prot, PROT_USER))
+        return false;
+
+    return true;
+}
+
+/*
+ * Try to populate the huge page containing 'va' within
+ * an anonymous region, this only works if the huge page
+ * lies within the region and nothing smaller is mapped
+ * there already.
+ */
+static int
+vmem_populate_huge(struct mu_vas *vas, struct vmem_region *rp, uintptr_t va)
+{
+    uintptr_t pma, block;
+    int error;
+
+    block = ALIGN_DOWN(va, HUGE_PAGESIZE);
+    if (block < rp->vma || block + HUGE_PAGESIZE > rp->vma + rp->length) {
+        return -EINVAL;
+    }
+
+    pma = mm_pmem_alloc_align(HUGE_PAGESIZE / PAGESIZE, HUGE_PAGESIZE);
+    if (pma == 0) {
+        return -ENOMEM;
+    }
+
+    memset(PHYS_TO_VIRT(pma), 0, HUGE_PAGESIZE);
+    error = mu_pmap_map(vas, block, pma, rp->prot, PAGESIZE_2M);
+    if (error != 0) {
+        mm_pmem_free(pma, HUGE_PAGESIZE / PAGESIZE);
+    }
+
+    return error;
+}
+
+/*
+ * Populate the page containing 'va' from the backing
+ * of a region.
+ */
+static int
+vmem_populate(struct mu_vas *vas, struct vmem_region *rp, uintptr_t va)
+{
+    uintptr_t pma;
+    int error;
+
+    va = ALIGN_DOWN(va, PAGESIZE);
+    switch (rp->backing) {
+    case VMEM_FIXED:
+        /*
+         * Once cloned the frames of a fixed region belong to
+         * the page tables and may have been copied away, the
+         * backing no longer describes them.
+         */
+        if (ISSET(rp->flags, VMEM_COW)) {
+            return -EFAULT;
+        }
+
+        pma = rp->pma + (va - rp->vma);
+        break;
+    case VMEM_OBJECT:
+        error = rp->pager->getpage(rp->object, rp->pma + (va - rp->vma), &pma);
+        if (error != 0) {
+            return error;
+        }
+
+        /*
+         * Private mappings copy the page on first write unless
+         * the pager handed us a frame nobody else holds.
+         */
+        if (!ISSET(rp->flags, VMEM_SHARED) && ISSET(rp->prot, PROT_WRITE) &&
+            mm_pmem_refcount(pma) > 1) {
+            error = mu_pmap_map(vas, va, pma, rp->prot | PROT_COW, PAGESIZE_4K);
+            if (error != 0)
+                mm_pmem_unref(pma);
+
+            return error;
+        }
+
+        break;
+    case VMEM_ANON:
+        /* Fall back to a small page if there is no huge one */
+        if (ISSET(rp->flags, VMEM_HUGE)) {
+            if (vmem_populate_huge(vas, rp, va) == 0)
+                return 0;
+        }
+
+        if ((pma = mm_pmem_alloc(1)) == 0) {
+            return -ENOMEM;
+        }
+
+        memset(PHYS_TO_VIRT(pma), 0, PAGESIZE);
+        break;
+    default:
+        return -EIO;
+    }
+
+    error = mu_pmap_map(vas, va, pma, rp->prot, PAGESIZE_4K);
+    if (error != 0 && rp->backing != VMEM_FIXED) {
+        mm_pmem_unref(pma);
+    }
+
+    return error;
+}
+
+/*
+ * Resolve a write to a shared copy-on-write page by giving
+ * the writer a private copy of it.
+ */
+static int
+vmem_cow(struct mu_vas *vas, struct vmem_region *rp, uintptr_t va,
+    uintptr_t pa)
+{
+    uintptr_t new_pa;
+    int error;
+
+    va = ALIGN_DOWN(va, PAGESIZE);
+    pa = ALIGN_DOWN(pa, PAGESIZE);
+
+    /* Nobody else holds it anymore, take it back as is */
+    if (mm_pmem_refcount(pa) <= 1) {
+        return mu_pmap_map(vas, va, pa, rp->prot, PAGESIZE_4K);
+    }
+
+    if ((new_pa = mm_pmem_alloc(1)) == 0) {
+        return -ENOMEM;
+    }
+
+    memcpy(PHYS_TO_VIRT(new_pa), PHYS_TO_VIRT(pa), PAGESIZE);
+    error = mu_pmap_map(vas, va, new_pa, rp->prot, PAGESIZE_4K);
+    if (error != 0) {
+        mm_pmem_free(new_pa, 1);
+        return error;
+    }
+
+    mm_pmem_unref(pa);
+    return 0;
+}
+
+/*
+ * Populate the prefetch window of an object backed region
+ * that follows a faulting page, this is best effort and
+ * stops at the first page that is already present or that
+ * cannot be populated.
+ */
+static void
+vmem_prefetch(struct mu_vas *vas, struct vmem_region *rp, uintptr_t va)
+{
+    uintptr_t end;
+
+    va = ALIGN_DOWN(va, PAGESIZE) + PAGESIZE;
+    end = va + (rp->pager->prefetch * PAGESIZE);
+    if (end > rp->vma + rp->length) {
+        end = rp->vma + rp->length;
+    }
+
+    for (; va < end; va += PAGESIZE) {
+        if (mu_pmap_translate(vas, va, NULL, NULL, NULL) == 0)
+            break;
+        if (vmem_populate(vas, rp, va) != 0)
+            break;
+    }
+}
+
+int
+vmem_fault(struct mu_vas *vas, uintptr_t va, int fault)
+{
+    struct vmem_map *map;
+    struct vmem_region *rp;
+    struct pmap_gather pg;
+    uintptr_t pa;
+    pagesize_t ps;
+    int prot, retval;
+
+    if (vas == NULL || (map = vas->map) == NULL) {
+        return -EFAULT;
+    }
+
+    spinlock_acquire(&map->lock, true);
+    if ((rp = vmem_map_lookup(map, va)) == NULL) {
+        spinlock_release(&map->lock);
+        return -EFAULT;
+    }
+
+    /* Is this access allowed at all? */
+    if (!vmem_fault_allowed(rp->prot, fault)) {
+        spinlock_release(&map->lock);
+        return -EACCES;
+    }
+
+    /*
+     * If a translation is already present it has either been
+     * resolved by someone else or we faulted on a stale TLB
+     * entry, in both cases we only need to drop the local
+     * entry and retry.
+     */
+    if (mu_pmap_translate(vas, va, &pa, &prot, &ps) == 0) {
+        if (ISSET(fault, VMEM_FAULT_WRITE) && ISSET(prot, PROT_COW)) {
+            /* Only copy the small page being written to */
+            retval = 0;
+            if (ps != PAGESIZE_4K) {
+                mu_pmap_gather_init(&pg, vas);
+                retval = mu_pmap_demote(&pg, va);
+                mu_pmap_gather_flush(&pg);
+            }
+
+            if (retval == 0) {
+                retval = vmem_cow(vas, rp, va, pa);
+            } else {
+                retval = -ENOMEM;
+            }
+
+            spinlock_release(&map->lock);
+            return retval;
+        }
+
+        retval = -EACCES;
+        if (vmem_fault_allowed(prot, fault)) {
+            mu_pmap_gather_init(&pg, vas);
+            mu_pmap_gather_add(&pg, ALIGN_DOWN(va, PAGESIZE), PAGESIZE);
+            mu_pmap_gather_flush(&pg);
+            retval = 0;
+        }
+
+        spinlock_release(&map->lock);
+        return retval;
+    }
+
+    retval = vmem_populate(vas, rp, va);
+    if (retval == 0 && rp->backing == VMEM_OBJECT) {
+        vmem_prefetch(vas, rp, va);
+    }
+
+    spinlock_release(&map->lock);
+    return retval;
+}
+
+/*
+ * Make sure every page of a region within [va, end) is
+ * mapped, the map must be locked.
+ */
+static int
+vmem_fill_region(struct mu_vas *vas, struct vmem_region *rp, uintptr_t va,
+    uintptr_t end)
+{
+    pagesize_t ps;
+    int error;
+
+    va = ALIGN_DOWN(va, PAGESIZE);
+    while (va < end) {
+        if (mu_pmap_translate(vas, va, NULL, NULL, &ps) == 0) {
+            va = (ps == PAGESIZE_4K) ? va + PAGESIZE :
+                ALIGN_DOWN(va, HUGE_PAGESIZE) + HUGE_PAGESIZE;
+            continue;
+        }
+
+        if ((error = vmem_populate(vas, rp, va)) != 0) {
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Unmap every page within [va, end) and drop a reference
+ * on the frames behind them. Huge pages only partially
+ * within the range are split first.
+ */
+static int
+vmem_release(struct pmap_gather *pg, uintptr_t va, uintptr_t end)
+{
+    uintptr_t pa, block;
+    pagesize_t ps;
+
+    while (va < end) {
+        if (mu_pmap_translate(pg->vas, va, &pa, NULL, &ps) != 0) {
+            va += PAGESIZE;
+            continue;
+        }
+
+        if (ps == PAGESIZE_4K) {
+            mu_pmap_remove(pg, va, PAGESIZE_4K);
+            mm_pmem_unref(ALIGN_DOWN(pa, PAGESIZE));
+            va += PAGESIZE;
+            continue;
+        }
+
+        block = ALIGN_DOWN(va, HUGE_PAGESIZE);
+        if (block < va || block + HUGE_PAGESIZE > end) {
+            if (mu_pmap_demote(pg, va) != 0)
+                return -ENOMEM;
+            continue;
+        }
+
+        mu_pmap_remove(pg, block, PAGESIZE_2M);
+        pa = ALIGN_DOWN(pa, HUGE_PAGESIZE);
+        for (size_t off = 0; off < HUGE_PAGESIZE; off += PAGESIZE) {
+            mm_pmem_unref(pa + off);
+        }
+
+        va = block + HUGE_PAGESIZE;
+    }
+
+    return 0;
+}
+
+int
+vmem_clone(struct mu_vas *src, struct mu_vas *dst)
+{
+    struct vmem_map *map, *dst_map;
+    struct vmem_region *rp, *copy;
+    struct pmap_gather pg;
+    uintptr_t end;
+    bool shared;
+    int error = 0;
+
+    if (src == NULL || dst == NULL) {
+        return -EINVAL;
+    }
+
+    if (mu_pmap_newvas(dst) != 0) {
+        return -ENOMEM;
+    }
+
+    if ((map = src->map) == NULL) {
+        return 0;
+    }
+
+    if ((dst_map = vmem_get_map(dst)) == NULL) {
+        mu_pmap_destroyvas(dst);
+        return -ENOMEM;
+    }
+
+    mu_pmap_gather_init(&pg, src);
+    spinlock_acquire(&map->lock, true);
+    rp = vmem_tree_first(map->root);
+    for (; rp != NULL; rp = vmem_tree_next(map->root, rp->vma)) {
+        /*
+         * Shared regions must be fully present so that both
+         * sides see the same frames, fixed ones so that their
+         * backing can be dropped.
+         */
+        shared = ISSET(rp->flags, VMEM_SHARED);
+        if (shared || (rp->backing == VMEM_FIXED &&
+            !ISSET(rp->flags, VMEM_COW))) {
+            end = rp->vma + rp->length;
+            if ((error = vmem_fill_region(src, rp, rp->vma, end)) != 0)
+                break;
+        }
+
+        if ((copy = os_pool_allocate(sizeof(*copy))) == NULL) {
+            error = -ENOMEM;
+            break;
+        }
+
+        if (!shared) {
+            rp->flags |= VMEM_COW;
+        }
+
+        *copy = *rp;
+        vmem_map_insert(dst_map, copy);
+        vmem_region_ref(copy);
+
+        if (mu_pmap_clone(&pg, dst, rp->vma, rp->length, !shared) != 0) {
+            error = -ENOMEM;
+            break;
+        }
+    }
+
+    /* The source lost write access to what it shares */
+    mu_pmap_gather_flush(&pg);
+    spinlock_release(&map->lock);
+
+    if (error != 0) {
+        vmem_destroy(dst);
+    }
+
+    return error;
+}
+
+/*
+ * Tear down every region of a subtree, dropping a
+ * reference on each frame mapped within it.
+ */
+static void
+vmem_tree_destroy(struct pmap_gather *pg, struct vmem_region *rp)
+{
+    if (rp == NULL) {
+        return;
+    }
+
+    vmem_tree_destroy(pg, rp->left);
+    vmem_tree_destroy(pg, rp->right);
+    vmem_release(pg, rp->vma, rp->vma + rp->length);
+    vmem_region_free(rp);
+}
+
+int
+vmem_destroy(struct mu_vas *vas)
+{
+    struct vmem_map *map;
+    struct pmap_gather pg;
+
+    if (vas == NULL) {
+        return -EINVAL;
+    }
+
+    if (vas->cpumask != 0) {
+        return -EBUSY;
+    }
+
+    if ((map = vas->map) != NULL) {
+        mu_pmap_gather_init(&pg, vas);
+        vmem_tree_destroy(&pg, map->root);
+        mu_pmap_gather_flush(&pg);
+        os_pool_free(map);
+        vas->map = NULL;
+    }
+
+    return (mu_pmap_destroyvas(vas) == 0) ? 0 : -EBUSY;
+}
+
+int
+vmem_prefault(struct mu_vas *vas, uintptr_t va, size_t length)
+{
+    struct vmem_map *map;
+    struct vmem_region *rp;
+    uintptr_t end, stop;
+    int error = 0;
+
+    if (vas == NULL || (map = vas->map) == NULL) {
+        return -EFAULT;
+    }
+
+    end = va + length;
+    va = ALIGN_DOWN(va, PAGESIZE);
+
+    spinlock_acquire(&map->lock, true);
+    while (va < end) {
+        if ((rp = vmem_map_lookup(map, va)) == NULL) {
+            error = -EFAULT;
+            break;
+        }
+
+        stop = rp->vma + rp->length;
+        if (stop > end) {
+            stop = end;
+        }
+
+        if ((error = vmem_fill_region(vas, rp, va, stop)) != 0) {
+            break;
+        }
+
+        va = stop;
+    }
+
+    spinlock_release(&map->lock);
+    return error;
+}
+
+int
+vmem_munmap(struct mu_vas *vas, uintptr_t va, size_t length)
+{
+    struct vmem_map *map;
+    struct vmem_region *rp, *tail = NULL;
+    struct pmap_gather pg;
+    uintptr_t end, start, stop, rp_end;
+    int error = 0;
+
+    if (vas == NULL || length == 0) {
+        return -EINVAL;
+    }
+
+    if (ISSET(va, PAGESIZE - 1)) {
+        return -EINVAL;
+    }
+
+    if ((map = vas->map) == NULL) {
+        return 0;
+    }
+
+    end = va + ALIGN_UP(length, PAGESIZE);
+    mu_pmap_gather_init(&pg, vas);
+    spinlock_acquire(&map->lock, true);
+    while ((rp = vmem_tree_overlap(map->root, va, end)) != NULL) {
+        rp_end = rp->vma + rp->length;
+        start = (va > rp->vma) ? va : rp->vma;
+        stop = (end < rp_end) ? end : rp_end;
+
+        /* Punching a hole takes a second region */
+        if (start > rp->vma && stop < rp_end && tail == NULL) {
+            spinlock_release(&map->lock);
+            tail = os_pool_allocate(sizeof(*tail));
+            spinlock_acquire(&map->lock, true);
+            if (tail == NULL) {
+                error = -ENOMEM;
+                break;
+            }
+
+            continue;
+        }
+
+        if ((error = vmem_release(&pg, start, stop)) != 0) {
+            break;
+        }
+
+        /*
+         * What remains of the region is re-inserted as its
+         * bounds are what the tree is keyed and augmented by.
+         */
+        map->root = vmem_tree_remove(map->root, rp);
+        --map->nregions;
+        if (stop < rp_end && start > rp->vma) {
+            *tail = *rp;
+            tail->vma = stop;
+            tail->pma += stop - rp->vma;
+            tail->length = rp_end - stop;
+            vmem_map_insert(map, tail);
+            vmem_region_ref(tail);
+            tail = NULL;
+        }
+
+        if (start > rp->vma) {
+            rp->length = start - rp->vma;
+            vmem_map_insert(map, rp);
+        } else if (stop < rp_end) {
+            rp->pma += stop - rp->vma;
+            rp->length = rp_end - stop;
+            rp->vma = stop;
+            vmem_map_insert(map, rp);
+        } else {
+            vmem_region_free(rp);
+        }
+
+        vmem_map_touch(map);
+    }
+
+    mu_pmap_gather_flush(&pg);
+    spinlock_release(&map->lock);
+
+    if (tail != NULL) {
+        os_pool_free(tail);
+    }
+
+    return error;
+}
+
+int
+vmem_mmap(struct mu_vas *vas, uintptr_t addr, size_t length, int prot,
+    int flags, uintptr_t *res)
+{
+    /* Nothing to map files from yet */
+    if (!ISSET(flags, MAP_ANON)) {
+        return -ENOTSUP;
+    }
+
+    return vmem_mmap_object(
+        vas, addr, length, prot, flags,
+        NULL, NULL, 0, res
+    );
+}
+
+int
+vmem_mmap_object(struct mu_vas *vas, uintptr_t addr, size_t length, int prot,
+    int flags, const struct vmem_pager *pager, void *obj, size_t off,
+    uintptr_t *res)
+{
+    struct vmem_region region;
+    size_t align = PAGESIZE;
+    uintptr_t va, lo;
+    int error;
+
+    if (vas == NULL || res == NULL || length == 0) {
+        return -EINVAL;
+    }
+
+    if (obj != NULL && (pager == NULL || ISSET(off, PAGESIZE - 1))) {
+        return -EINVAL;
+    }
+
+    /* Exactly one of shared or private */
+    if (!ISSET(flags, MAP_SHARED) == !ISSET(flags, MAP_PRIVATE)) {
+        return -EINVAL;
+    }
+
+    length = ALIGN_UP(length, PAGESIZE);
+    if (obj == NULL && ISSET(flags, MAP_HUGE) && length >= HUGE_PAGESIZE) {
+        align = HUGE_PAGESIZE;
+    }
+
+    if (ISSET(flags, MAP_FIXED)) {
+        if (ISSET(addr, PAGESIZE - 1)) {
+            return -EINVAL;
+        }
+
+        va = addr;
+    } else {
+        /* The address is only a hint, start looking there */
+        lo = (addr != 0) ? ALIGN_UP(addr, PAGESIZE) : MD_MMAP_BASE;
+        error = vmem_find_gap(vas, length, align, lo, MD_USER_MAX, &va);
+        if (error != 0 && lo != MD_MMAP_BASE) {
+            error = vmem_find_gap(
+                vas, length, align,
+                MD_MMAP_BASE, MD_USER_MAX, &va
+            );
+        }
+
+        if (error != 0) {
+            return error;
+        }
+    }
+
+    if (va < MD_USER_MIN || va + length > MD_USER_MAX || va + length < va) {
+        return -EINVAL;
+    }
+
+    region.vma = va;
+    region.pma = off;
+    region.length = length;
+    region.prot = (prot & (PROT_WRITE | PROT_EXEC)) | PROT_USER;
+    region.backing = (obj != NULL) ? VMEM_OBJECT : VMEM_ANON;
+    region.flags = 0;
+    region.pager = pager;
+    region.object = obj;
+    if (ISSET(flags, MAP_SHARED))
+        region.flags |= VMEM_SHARED;
+    if (obj == NULL && ISSET(flags, MAP_HUGE))
+        region.flags |= VMEM_HUGE;
+
+    if ((error = vmem_region_add(vas, &region)) != 0) {
+        return error;
+    }
+
+    if (ISSET(flags, MAP_POPULATE)) {
+        if ((error = vmem_prefault(vas, va, length)) != 0) {
+            vmem_munmap(vas, va, length);
             return error;
         }
     }
 
+    *res = va;
     return 0;
 }
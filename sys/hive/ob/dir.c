@@ -31,8 +31,234 @@
 #include <sys/types.h>
 #include <sys/queue.h>
 #include <sys/errno.h>
+#include <sys/cdefs.h>
+#include <sys/atomic.h>
 #include <os/pool.h>
 #include <ob/dir.h>
+#include <ob/rcu.h>
+#include <lib/string.h>
+#include <lib/stdbool.h>
+
+/* Initial number of buckets of a directory */
+#define DIR_NBUCKETS 8
+
+/* Number of entries per bucket that triggers a resize */
+#define DIR_LOAD_MAX 2
+
+/* Buckets moved to the new table per insertion */
+#define DIR_REHASH_STEP 4
+
+static struct knode_htab *
+dir_htab_new(struct knode_dir *dir, size_t nbuckets, int link)
+{
+    struct knode_htab *htab;
+    size_t len = nbuckets * sizeof(*htab->buckets);
+
+    if ((htab = os_pool_allocate(sizeof(*htab) + len)) == NULL) {
+        return NULL;
+    }
+
+    memset((void *)htab->buckets, 0, len);
+    htab->nbuckets = nbuckets;
+    htab->link = link;
+    htab->dir = dir;
+    return htab;
+}
+
+/*
+ * Link a knode into a table, readers may walk the
+ * chain at any point so it is only published once
+ * the link is in place.
+ */
+static inline void
+dir_htab_insert(struct knode_htab *htab, struct knode *knp)
+{
+    struct knode *volatile *bucket;
+
+    bucket = &htab->buckets[knp->hash & (htab->nbuckets - 1)];
+    knp->hash_link[htab->link] = *bucket;
+    atomic_store_release(bucket, knp);
+}
+
+/*
+ * Unlink a knode from a table, its own link is left
+ * alone so readers standing on it can move on.
+ */
+static void
+dir_htab_remove(struct knode_htab *htab, struct knode *knp)
+{
+    struct knode *volatile *pp;
+    int link = htab->link;
+
+    pp = &htab->buckets[knp->hash & (htab->nbuckets - 1)];
+    while (*pp != NULL) {
+        if (*pp == knp) {
+            atomic_store_release(pp, knp->hash_link[link]);
+            return;
+        }
+
+        pp = &(*pp)->hash_link[link];
+    }
+}
+
+/*
+ * Compare a knode name against one that need not be
+ * terminated.
+ */
+static inline bool
+dir_name_eq(struct knode *knp, const char *name, size_t len)
+{
+    if (memcmp(knp->name, name, len) != 0) {
+        return false;
+    }
+
+    return knp->name[len] == '\0';
+}
+
+static struct knode *
+dir_htab_find(struct knode_htab *htab, const char *name, size_t len,
+    uint32_t hash)
+{
+    struct knode *knp;
+    int link;
+
+    if (htab == NULL) {
+        return NULL;
+    }
+
+    link = htab->link;
+    knp = atomic_load_consume(&htab->buckets[hash & (htab->nbuckets - 1)]);
+    while (knp != NULL) {
+        if (knp->hash == hash && dir_name_eq(knp, name, len))
+            return knp;
+
+        knp = atomic_load_consume(&knp->hash_link[link]);
+    }
+
+    return NULL;
+}
+
+/*
+ * Free a table grown out of once readers are done with
+ * it, its link is free to be reused from then on. This
+ * runs before the directory can be destroyed as it was
+ * queued first.
+ */
+static void
+dir_htab_retire(void *arg)
+{
+    struct knode_htab *htab = arg;
+
+    atomic_store_release(&htab->dir->retired, NULL);
+    os_pool_free(htab);
+}
+
+/*
+ * Move up to 'count' buckets from the current table
+ * to the one being grown into, the new table takes
+ * over once the last one has been moved.
+ *
+ * The new table chains through the other link, so
+ * the old chains stay intact for readers still on
+ * them. The old table is left in 'retired' for the
+ * caller to hand to dir_htab_retire() once unlocked.
+ */
+static void
+dir_rehash(struct knode_dir *dir, size_t count)
+{
+    struct knode_htab *old = dir->tab[0];
+    struct knode_htab *new = dir->tab[1];
+    struct knode *knp;
+
+    if (new == NULL) {
+        return;
+    }
+
+    while (count-- > 0 && dir->rehash_idx < old->nbuckets) {
+        knp = old->buckets[dir->rehash_idx++];
+        while (knp != NULL) {
+            dir_htab_insert(new, knp);
+            knp = knp->hash_link[old->link];
+        }
+    }
+
+    if (dir->rehash_idx < old->nbuckets) {
+        return;
+    }
+
+    /* See ob_dir_lookup() for the order */
+    atomic_store_release(&dir->tab[0], new);
+    atomic_store_release(&dir->tab[1], NULL);
+    dir->rehash_idx = 0;
+    dir->retired = old;
+}
+
+/*
+ * Hash a new entry, growing the table once it
+ * gets too crowded. Returns the table the growth
+ * just finished with, if any.
+ */
+static struct knode_htab *
+dir_hash_insert(struct knode_dir *dir, struct knode *knp)
+{
+    struct knode_htab *cur = dir->tab[0];
+    struct knode_htab *retire = NULL;
+
+    /*
+     * The new table is twice as large, a resize is long
+     * done by the time it fills up enough for the next.
+     * It may not start while readers could still be on
+     * the link of the last table retired, though.
+     */
+    if (dir->tab[1] != NULL) {
+        dir_rehash(dir, DIR_REHASH_STEP);
+        if (dir->tab[1] == NULL)
+            retire = dir->retired;
+    } else if (dir->retired == NULL &&
+        dir->entry_count >= cur->nbuckets * DIR_LOAD_MAX) {
+        dir->rehash_idx = 0;
+        atomic_store_release(&dir->tab[1],
+            dir_htab_new(dir, cur->nbuckets << 1, !cur->link));
+    }
+
+    if (dir->tab[1] != NULL) {
+        dir_htab_insert(dir->tab[1], knp);
+    } else {
+        dir_htab_insert(dir->tab[0], knp);
+    }
+
+    return retire;
+}
+
+/*
+ * Resolve the directory a knode is to be added to
+ * or removed from, NULL being the root.
+ */
+static int
+dir_get(struct knode *dir_kn, struct knode_dir **res)
+{
+    int error;
+
+    if (dir_kn == NULL) {
+        error = ob_root_get("/", &dir_kn);
+        if (error != 0)
+            return error;
+    }
+    if (dir_kn == NULL) {
+        return -ENOENT;
+    }
+
+    /* This must be a directory */
+    if (dir_kn->type != K_DIR) {
+        return -ENOTSUP;
+    }
+
+    if ((*res = dir_kn->data) == NULL) {
+        return -EIO;
+    }
+
+    return 0;
+}
 
 int
 ob_dir_new(const char *name, struct knode **res)
@@ -60,6 +286,80 @@ ob_dir_new(const char *name, struct knode **res)
     dirp = knp->data;
     TAILQ_INIT(&dirp->list);
     dirp->entry_count = 0;
+    dirp->gen = 0;
+    dirp->lock = 0;
+    dirp->tab[1] = NULL;
+    dirp->rehash_idx = 0;
+    dirp->retired = NULL;
+    if ((dirp->tab[0] = dir_htab_new(dirp, DIR_NBUCKETS, 0)) == NULL) {
+        os_pool_free(dirp);
+        os_pool_free(knp);
+        return -ENOMEM;
+    }
+
+    *res = knp;
+    return 0;
+}
+
+int
+ob_dir_lookup(struct knode *dir_kn, const char *name, struct knode **res)
+{
+    size_t len;
+
+    if (name == NULL) {
+        return -EINVAL;
+    }
+
+    len = strlen(name);
+    return ob_dir_lookup_slice(dir_kn, name, len, ob_name_hash(name, len),
+        res);
+}
+
+int
+ob_dir_lookup_slice(struct knode *dir_kn, const char *name, size_t len,
+    uint32_t hash, struct knode **res)
+{
+    struct knode *knp;
+    struct knode_htab *cur, *new;
+    struct knode_dir *dir;
+
+    if (dir_kn == NULL || name == NULL) {
+        return -EINVAL;
+    }
+
+    if (res == NULL) {
+        return -EINVAL;
+    }
+
+    /* Is this actually a directory? */
+    if (dir_kn->type != K_DIR) {
+        return -ENOTDIR;
+    }
+
+    /* No such name can exist */
+    if (len >= KNODE_NAME_LEN) {
+        return -ENOENT;
+    }
+
+    /*
+     * Entries may still be in the table being moved from.
+     * The grown table is read first: should a resize finish
+     * in between, it is the one in 'tab[0]' by then.
+     */
+    dir = KNODE_DIR(dir_kn);
+    ob_rcu_enter();
+    new = atomic_load_consume(&dir->tab[1]);
+    cur = atomic_load_consume(&dir->tab[0]);
+    knp = dir_htab_find(cur, name, len, hash);
+    if (knp == NULL && new != cur) {
+        knp = dir_htab_find(new, name, len, hash);
+    }
+    ob_rcu_exit();
+
+    if (knp == NULL) {
+        return -ENOENT;
+    }
+
     *res = knp;
     return 0;
 }
@@ -67,6 +367,7 @@ ob_dir_new(const char *name, struct knode **res)
 int
 ob_dir_append(struct knode *knp, struct knode *dir_kn)
 {
+    struct knode_htab *retire;
     struct knode_dir *dir;
     int error;
 
@@ -79,25 +380,102 @@ ob_dir_append(struct knode *knp, struct knode *dir_kn)
      * the knode to is specified as NULL, attempt
      * to default at the root.
      */
-    if (dir_kn == NULL) {
-        error = ob_root_get("/", &dir_kn);
-        if (error != 0)
-            return error;
+    if ((error = dir_get(dir_kn, &dir)) != 0) {
+        return error;
     }
-    if (dir_kn == NULL) {
-        return -ENOENT;
+
+    /* Readers may run off the tail while it is linked */
+    knp->dir_link.tqe_next = NULL;
+    atomic_fence();
+
+    spinlock_acquire(&dir->lock, true);
+    retire = dir_hash_insert(dir, knp);
+    TAILQ_INSERT_TAIL(&dir->list, knp, dir_link);
+    ++dir->entry_count;
+    ++dir->gen;
+    spinlock_release(&dir->lock);
+
+    /*
+     * Never wait on readers nor run callbacks locked. Until
+     * the retired table is gone the directory cannot grow,
+     * so keep nudging it along.
+     */
+    if (retire != NULL) {
+        ob_rcu_call(dir_htab_retire, retire);
+    } else if (dir->retired != NULL) {
+        ob_rcu_poll();
     }
 
-    /* This must be a directory */
-    if (dir_kn->type != K_DIR) {
-        return -ENOTSUP;
+    return 0;
+}
+
+int
+ob_dir_remove(struct knode *knp, struct knode *dir_kn)
+{
+    struct knode_dir *dir, *sub;
+    struct knode *tmp;
+    size_t len;
+    int error;
+
+    if (knp == NULL) {
+        return -EINVAL;
     }
 
-    if ((dir = dir_kn->data) == NULL) {
-        return -EIO;
+    if ((error = dir_get(dir_kn, &dir)) != 0) {
+        return error;
     }
 
-    TAILQ_INSERT_TAIL(&dir->list, knp, dir_link);
-    ++dir->entry_count;
+    sub = (knp->type == K_DIR) ? KNODE_DIR(knp) : NULL;
+    spinlock_acquire(&dir->lock, true);
+    if (sub != NULL && sub->entry_count > 0) {
+        spinlock_release(&dir->lock);
+        return -EBUSY;
+    }
+
+    /* Make sure it is actually ours */
+    len = strlen(knp->name);
+    tmp = dir_htab_find(dir->tab[0], knp->name, len, knp->hash);
+    if (tmp == NULL) {
+        tmp = dir_htab_find(dir->tab[1], knp->name, len, knp->hash);
+    }
+    if (tmp != knp) {
+        spinlock_release(&dir->lock);
+        return -ENOENT;
+    }
+
+    /*
+     * Mid resize it may sit in both tables. The queue
+     * unlink leaves its own next pointer in place for
+     * readers iterating over it.
+     */
+    dir_htab_remove(dir->tab[0], knp);
+    if (dir->tab[1] != NULL) {
+        dir_htab_remove(dir->tab[1], knp);
+    }
+
+    TAILQ_REMOVE(&dir->list, knp, dir_link);
+    --dir->entry_count;
+    ++dir->gen;
+    spinlock_release(&dir->lock);
+
+    ob_knode_unbias(knp);
+    ob_knode_unref(knp);
     return 0;
 }
+
+void
+ob_dir_destroy(struct knode *dir_kn)
+{
+    struct knode_dir *dir;
+
+    if (dir_kn == NULL || (dir = dir_kn->data) == NULL) {
+        return;
+    }
+
+    os_pool_free(dir->tab[0]);
+    if (dir->tab[1] != NULL) {
+        os_pool_free(dir->tab[1]);
+    }
+
+    os_pool_free(dir);
+}
@@ -30,45 +30,125 @@
 #include <sys/errno.h>
 #include <sys/queue.h>
 #include <sys/cdefs.h>
+#include <sys/atomic.h>
+#include <lib/stdbool.h>
+#include <mu/cpu.h>
 #include <ob/knode.h>
 #include <ob/dir.h>
+#include <ob/pcache.h>
+#include <ob/rcu.h>
 #include <os/pool.h>
 #include <lib/string.h>
 
-static int
-knode_subdir_find(struct knode *parent, const char *name, struct knode **res)
+/* FNV-1a parameters */
+#define FNV_OFFSET 0x811C9DC5U
+#define FNV_PRIME  0x01000193U
+#define FNV_STEP(HASH, C) (((HASH) ^ (uint8_t)(C)) * FNV_PRIME)
+
+/*
+ * Per-CPU reference count of a biased knode, counts
+ * may go negative on their own as references are often
+ * dropped on another processor than they were taken on.
+ *
+ * @count: References taken minus references dropped
+ */
+struct knode_pcref {
+    volatile uint64_t count;
+} ALIGN(64);
+
+/*
+ * Held on the shared count of a biased knode. References
+ * taken per-CPU may be dropped on the shared count as it
+ * is being unbiased, before their per-CPU counts are
+ * folded in, so it must not reach zero meanwhile.
+ */
+#define KNODE_REF_BIAS (1U << 30)
+
+/*
+ * The directory part of the last path resolved within
+ * a read side section, paths sharing it resume from
+ * there rather than walk it again.
+ *
+ * @path: Path the prefix was taken from
+ * @len: Length of the prefix
+ * @dir: Knode the prefix resolved to
+ * @error: Error resolving the prefix failed with
+ * @trail: Directories the prefix walk went through
+ * @valid: Set once a prefix was resolved
+ */
+struct knode_prefix {
+    const char *path;
+    size_t len;
+    struct knode *dir;
+    int error;
+    struct pcache_trail trail;
+    bool valid;
+};
+
+static knode_dtor_t knode_dtors[K_MAX];
+
+static inline struct knode_pcref *
+knode_pcref_self(struct knode_pcref *pcref)
 {
-    struct knode *knp;
-    struct knode_dir *pardir;
-    int retval = -ENOENT;
+    struct pcr *self;
 
-    if (parent == NULL || name == NULL) {
-        return -EINVAL;
-    }
+    self = mu_cpu_self();
+    return &pcref[(self != NULL) ? self->id : 0];
+}
 
-    if (res == NULL) {
-        return -EINVAL;
+/*
+ * Destroy a knode, invoked once no reader can still
+ * see it.
+ */
+static void
+knode_destroy(void *arg)
+{
+    struct knode *knp = arg;
+    knode_dtor_t dtor = knode_dtors[knp->type];
+
+    if (dtor != NULL) {
+        dtor(knp);
     }
 
-    /* Is this actually a directory? */
-    if (parent->type != K_DIR) {
-        return -ENOTDIR;
+    os_pool_free(knp);
+}
+
+/*
+ * Take a reference on a knode reached without one, this
+ * fails if it is already on its way out. Must be called
+ * from within a read side section.
+ */
+static bool
+knode_tryref(struct knode *knp)
+{
+    struct knode_pcref *pcref;
+    unsigned int ref;
+
+    /* Biased knodes always have a reference left */
+    pcref = atomic_load_consume(&knp->pcref);
+    if (pcref != NULL) {
+        atomic_inc_64(&knode_pcref_self(pcref)->count);
+        return true;
     }
 
-    pardir = KNODE_DIR(parent);
-    TAILQ_FOREACH(knp, &pardir->list, dir_link) {
-        if (LIKELY(knp->name[0] != *name)) {
-            continue;
-        }
+    do {
+        if ((ref = knp->ref) == 0)
+            return false;
+    } while (!atomic_cas_int(&knp->ref, ref, ref + 1));
 
-        if (strcmp(knp->name, name) == 0) {
-            *res = knp;
-            retval = 0;
-            break;
-        }
+    return true;
+}
+
+uint32_t
+ob_name_hash(const char *name, size_t len)
+{
+    uint32_t hash = FNV_OFFSET;
+
+    for (size_t i = 0; i < len; ++i) {
+        hash = FNV_STEP(hash, name[i]);
     }
 
-    return retval;
+    return hash;
 }
 
 int
@@ -98,52 +178,51 @@ ob_knode_new(const char *name, ktype_t type, struct knode **res)
 
     knp->type = type;
     knp->ref = 1;
+    knp->pcref = NULL;
+    knp->hash = ob_name_hash(name, name_len);
+    knp->hash_link[0] = NULL;
+    knp->hash_link[1] = NULL;
     *res = knp;
     return 0;
 }
 
-int
-ob_knode_resolve(const char *path, int flags, struct knode **res)
+/*
+ * Walk 'len' bytes of a path from 'knp', recording each
+ * directory searched along the way. Components are looked
+ * up in place and hashed as they are scanned.
+ */
+static int
+knode_walk(struct knode *knp, const char *path, size_t len,
+    struct pcache_trail *trail, struct knode **res)
 {
-    struct knode *knp = NULL;
-    const char *p;
-    char pathbuf[128];
-    size_t pathbuf_idx = 0;
+    const char *p = path, *end = path + len;
+    const char *name;
+    uint32_t hash;
     int error;
 
-    if (path == NULL || res == NULL) {
-        return -EINVAL;
-    }
-
-    p = path;
-    while (*p != '\0') {
-        /* Skip leading slashes */
-        while (*p == '/' && *p != '\0') {
+    while (p < end) {
+        /* Skip leading and trailing slashes */
+        if (*p == '/') {
             ++p;
+            continue;
         }
 
-        /* Fill the component buffer */
-        while (*p != '/' && *p != '\0') {
-            if (pathbuf_idx >= sizeof(pathbuf) - 1) {
-                return -ENAMETOOLONG;
-            }
-
-            pathbuf[pathbuf_idx++] = *p++;
+        name = p;
+        hash = FNV_OFFSET;
+        while (p < end && *p != '/') {
+            hash = FNV_STEP(hash, *p++);
         }
 
-        pathbuf[pathbuf_idx] = '\0';
-        pathbuf_idx = 0;
-
-        /* Do we need to search the root? */
-        if (knp == NULL) {
-            if ((error = ob_root_get(pathbuf, &knp)) != 0)
-                return error;
-
-            continue;
+        if ((size_t)(p - name) >= KNODE_NAME_LEN - 1) {
+            return -ENAMETOOLONG;
         }
 
         /* Lookup the subdirectory now */
-        error = knode_subdir_find(knp, pathbuf, &knp);
+        if (knp->type == K_DIR) {
+            ob_pcache_note(trail, knp);
+        }
+
+        error = ob_dir_lookup_slice(knp, name, p - name, hash, &knp);
         if (error != 0) {
             return error;
         }
@@ -152,3 +231,242 @@ ob_knode_resolve(const char *path, int flags, struct knode **res)
     *res = knp;
     return 0;
 }
+
+/*
+ * Resolve a path within a read side section, absolute
+ * paths and a NULL base start at the root. Only those
+ * are cached: a base directory may be freed and another
+ * allocated in its place.
+ */
+static int
+knode_resolve(struct knode *base, const char *path, struct knode_prefix *pfx,
+    struct knode **res)
+{
+    struct pcache_trail trail;
+    struct knode *knp;
+    size_t len, dirlen;
+    uint32_t hash;
+    bool cache;
+    int error;
+
+    len = strlen(path);
+    cache = (*path == '/' || base == NULL);
+    if (cache) {
+        if ((error = ob_root_get("/", &base)) != 0)
+            return error;
+    } else if (base->type != K_DIR) {
+        return -ENOTDIR;
+    }
+
+    /* Repeated lookups only cost a probe of the cache */
+    hash = cache ? ob_name_hash(path, len) : 0;
+    if (cache && ob_pcache_lookup(path, len, hash, &error, &knp)) {
+        goto done;
+    }
+
+    /* Everything up to and including the last slash */
+    dirlen = len;
+    while (dirlen > 0 && path[dirlen - 1] != '/') {
+        --dirlen;
+    }
+
+    if (!pfx->valid || pfx->len != dirlen ||
+        memcmp(pfx->path, path, dirlen) != 0) {
+        pfx->path = path;
+        pfx->len = dirlen;
+        pfx->valid = true;
+        pfx->trail.depth = 0;
+        pfx->trail.overflow = false;
+        pfx->error = knode_walk(base, path, dirlen, &pfx->trail, &pfx->dir);
+    }
+
+    trail = pfx->trail;
+    knp = pfx->dir;
+    error = pfx->error;
+    if (error == 0) {
+        error = knode_walk(knp, &path[dirlen], len - dirlen, &trail, &knp);
+    }
+
+    if (cache) {
+        ob_pcache_enter(path, len, hash, &trail, error,
+            (error == 0) ? knp : NULL);
+    }
+done:
+    if (error == 0 && !knode_tryref(knp)) {
+        error = -ENOENT;
+    }
+
+    if (error == 0) {
+        *res = knp;
+    }
+
+    return error;
+}
+
+int
+ob_knode_set_dtor(ktype_t type, knode_dtor_t dtor)
+{
+    if (type >= K_MAX) {
+        return -EINVAL;
+    }
+
+    knode_dtors[type] = dtor;
+    return 0;
+}
+
+void
+ob_knode_ref(struct knode *knp)
+{
+    struct knode_pcref *pcref;
+
+    if (knp == NULL) {
+        return;
+    }
+
+    /* The bias may not be folded while we are at it */
+    ob_rcu_enter();
+    pcref = atomic_load_consume(&knp->pcref);
+    if (pcref != NULL) {
+        atomic_inc_64(&knode_pcref_self(pcref)->count);
+    } else {
+        atomic_inc_int(&knp->ref);
+    }
+    ob_rcu_exit();
+}
+
+void
+ob_knode_unref(struct knode *knp)
+{
+    struct knode_pcref *pcref;
+
+    if (knp == NULL) {
+        return;
+    }
+
+    ob_rcu_enter();
+    pcref = atomic_load_consume(&knp->pcref);
+    if (pcref != NULL) {
+        atomic_dec_64(&knode_pcref_self(pcref)->count);
+        ob_rcu_exit();
+        return;
+    }
+    ob_rcu_exit();
+
+    /* Lookups may still be on their way to it */
+    if (atomic_dec_int(&knp->ref) == 0) {
+        ob_rcu_call(knode_destroy, knp);
+    }
+}
+
+int
+ob_knode_bias(struct knode *knp)
+{
+    struct knode_pcref *pcref;
+    size_t len = sizeof(*pcref) * CPU_MAX;
+
+    if (knp == NULL) {
+        return -EINVAL;
+    }
+
+    if ((pcref = os_pool_allocate(len)) == NULL) {
+        return -ENOMEM;
+    }
+
+    /* Counts start at zero, the shared one keeps the rest */
+    memset(pcref, 0, len);
+    atomic_add_int_nv(&knp->ref, KNODE_REF_BIAS);
+    if (!atomic_cas_ptr(&knp->pcref, NULL, pcref)) {
+        atomic_sub_int_nv(&knp->ref, KNODE_REF_BIAS);
+        os_pool_free(pcref);
+    }
+
+    return 0;
+}
+
+void
+ob_knode_unbias(struct knode *knp)
+{
+    struct knode_pcref *pcref;
+    uint64_t sum = 0;
+
+    if (knp == NULL) {
+        return;
+    }
+
+    pcref = knp->pcref;
+    if (pcref == NULL || !atomic_cas_ptr(&knp->pcref, pcref, NULL)) {
+        return;
+    }
+
+    /*
+     * Once everyone that may have seen the per-CPU counts
+     * is done, they stay put. Only their sum matters, the
+     * truncation to the shared counter's width included.
+     */
+    ob_rcu_synchronize();
+    for (size_t i = 0; i < CPU_MAX; ++i) {
+        sum += pcref[i].count;
+    }
+
+    atomic_add_int_nv(&knp->ref, (unsigned int)sum - KNODE_REF_BIAS);
+    os_pool_free(pcref);
+}
+
+int
+ob_knode_resolve(const char *path, int flags, struct knode **res)
+{
+    return ob_knode_resolve_at(NULL, path, flags, res);
+}
+
+int
+ob_knode_resolve_at(struct knode *base, const char *path, int flags,
+    struct knode **res)
+{
+    struct knode_prefix pfx;
+    int error;
+
+    if (path == NULL || res == NULL) {
+        return -EINVAL;
+    }
+
+    pfx.valid = false;
+    ob_rcu_enter();
+    error = knode_resolve(base, path, &pfx, res);
+    ob_rcu_exit();
+    return error;
+}
+
+int
+ob_knode_resolve_batch(struct knode *base, const char **paths, size_t count,
+    int flags, struct knode **res)
+{
+    struct knode_prefix pfx;
+    int error, retval = 0;
+
+    if (paths == NULL || res == NULL) {
+        return -EINVAL;
+    }
+
+    /*
+     * Related paths tend to be listed together, each walk
+     * picks up where the previous one left off if they
+     * share a directory.
+     */
+    pfx.valid = false;
+    ob_rcu_enter();
+    for (size_t i = 0; i < count; ++i) {
+        res[i] = NULL;
+        if (paths[i] == NULL) {
+            error = -EINVAL;
+        } else {
+            error = knode_resolve(base, paths[i], &pfx, &res[i]);
+        }
+
+        if (error != 0 && retval == 0) {
+            retval = error;
+        }
+    }
+    ob_rcu_exit();
+
+    return retval;
+}
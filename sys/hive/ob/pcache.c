@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2025 Ian Marco Moffett and the OpenModality engineers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/atomic.h>
+#include <core/spinlock.h>
+#include <lib/string.h>
+#include <ob/knode.h>
+#include <ob/dir.h>
+#include <ob/pcache.h>
+
+/* Number of cached paths, a power of two */
+#define PCACHE_SIZE 64
+
+/* Longest path that may be cached */
+#define PCACHE_PATH_LEN 64
+
+/*
+ * Represents a cached path lookup, readers take no
+ * lock and instead retry if 'seq' was odd or changed
+ * while they read the entry.
+ *
+ * @seq: Bumped before and after each update
+ * @hash: Hash of the path, zero if unused
+ * @len: Length of the path
+ * @path: Path that was resolved
+ * @knp: Knode the path resolved to, NULL if negative
+ * @error: Error the lookup failed with if negative
+ * @trail: Directories the result depends on
+ */
+struct pcache_entry {
+    volatile uint32_t seq;
+    uint32_t hash;
+    size_t len;
+    char path[PCACHE_PATH_LEN];
+    struct knode *knp;
+    int error;
+    struct pcache_trail trail;
+};
+
+static struct pcache_entry pcache[PCACHE_SIZE];
+static spinlock_t pcache_lock;
+
+/*
+ * Returns true if no directory along a trail has
+ * changed since it was recorded.
+ *
+ * Checked in walk order: a directory cannot have been
+ * removed while its parent's generation still matches,
+ * so each one is still safe to look at.
+ */
+static bool
+pcache_trail_valid(struct pcache_trail *trail)
+{
+    struct knode_dir *dir;
+
+    for (size_t i = 0; i < trail->depth; ++i) {
+        dir = KNODE_DIR(trail->dirs[i]);
+        if (dir->gen != trail->gens[i])
+            return false;
+    }
+
+    return true;
+}
+
+void
+ob_pcache_note(struct pcache_trail *trail, struct knode *dir_kn)
+{
+    struct knode_dir *dir;
+
+    if (trail->depth >= PCACHE_DEPTH) {
+        trail->overflow = true;
+        return;
+    }
+
+    dir = KNODE_DIR(dir_kn);
+    trail->dirs[trail->depth] = dir_kn;
+    trail->gens[trail->depth++] = dir->gen;
+}
+
+bool
+ob_pcache_lookup(const char *path, size_t len, uint32_t hash,
+    int *error, struct knode **res)
+{
+    struct pcache_entry *ent;
+    struct pcache_trail trail;
+    struct knode *knp;
+    uint32_t seq;
+    int ent_error;
+
+    if (len >= PCACHE_PATH_LEN || hash == 0) {
+        return false;
+    }
+
+    /* Being updated, just walk the path */
+    ent = &pcache[hash & (PCACHE_SIZE - 1)];
+    seq = atomic_load_acquire(&ent->seq);
+    if ((seq & 1) != 0) {
+        return false;
+    }
+
+    if (ent->hash != hash || ent->len != len) {
+        return false;
+    }
+    if (memcmp(ent->path, path, len) != 0) {
+        return false;
+    }
+
+    /*
+     * The copy may be torn by a concurrent update,
+     * nothing in it is used before 'seq' says it is not.
+     */
+    knp = ent->knp;
+    ent_error = ent->error;
+    trail = ent->trail;
+    atomic_fence_acquire();
+    if (ent->seq != seq) {
+        return false;
+    }
+
+    if (!pcache_trail_valid(&trail)) {
+        return false;
+    }
+
+    *error = ent_error;
+    *res = knp;
+    return true;
+}
+
+void
+ob_pcache_enter(const char *path, size_t len, uint32_t hash,
+    struct pcache_trail *trail, int error, struct knode *knp)
+{
+    struct pcache_entry *ent;
+
+    if (len >= PCACHE_PATH_LEN || hash == 0 || trail->overflow) {
+        return;
+    }
+
+    /* Only results that hold until a directory changes */
+    if (error != 0 && error != -ENOENT && error != -ENOTDIR) {
+        return;
+    }
+
+    /* Caching is best effort, never wait on it */
+    if (!spinlock_try(&pcache_lock)) {
+        return;
+    }
+
+    ent = &pcache[hash & (PCACHE_SIZE - 1)];
+    ++ent->seq;
+    atomic_fence();
+    memcpy(ent->path, path, len);
+    ent->hash = hash;
+    ent->len = len;
+    ent->knp = knp;
+    ent->error = error;
+    ent->trail = *trail;
+    atomic_fence();
+    ++ent->seq;
+    spinlock_release(&pcache_lock);
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2025 Ian Marco Moffett and the OpenModality engineers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/cdefs.h>
+#include <sys/atomic.h>
+#include <sys/queue.h>
+#include <core/spinlock.h>
+#include <mu/cpu.h>
+#include <os/pool.h>
+#include <ob/rcu.h>
+
+/*
+ * Read side state of a processor, each sits on its own
+ * cacheline so entering and leaving a section only ever
+ * touches local memory.
+ *
+ * @epoch: Epoch observed on entry, zero if quiescent
+ * @nest: Read side nesting depth
+ */
+struct rcu_cpu {
+    volatile uint64_t epoch;
+    volatile uint32_t nest;
+} ALIGN(64);
+
+/*
+ * Represents a callback waiting on readers to drain
+ *
+ * @fn: Callback to invoke
+ * @arg: Argument to pass to 'fn'
+ * @epoch: Epoch it was queued in
+ * @link: Deferred list link
+ */
+struct rcu_deferred {
+    void (*fn)(void *arg);
+    void *arg;
+    uint64_t epoch;
+    TAILQ_ENTRY(rcu_deferred) link;
+};
+
+static struct rcu_cpu rcu_cpus[CPU_MAX];
+static volatile uint64_t rcu_epoch = 1;
+static TAILQ_HEAD(, rcu_deferred) deferred =
+    TAILQ_HEAD_INITIALIZER(deferred);
+static spinlock_t deferred_lock;
+
+static inline struct rcu_cpu *
+rcu_self(void)
+{
+    struct pcr *self;
+
+    self = mu_cpu_self();
+    return &rcu_cpus[(self != NULL) ? self->id : 0];
+}
+
+/*
+ * Returns the oldest epoch observed by an active read
+ * side section, UINT64 max if there are none.
+ */
+static uint64_t
+rcu_oldest(void)
+{
+    uint64_t epoch, oldest = (uint64_t)-1;
+
+    /* Order prior unlinks against the scan */
+    atomic_fence();
+    for (size_t i = 0; i < CPU_MAX; ++i) {
+        epoch = rcu_cpus[i].epoch;
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    return oldest;
+}
+
+/*
+ * Run every deferred callback that no read side
+ * section can still be in the way of.
+ */
+static void
+rcu_reclaim(void)
+{
+    TAILQ_HEAD(, rcu_deferred) ready;
+    struct rcu_deferred *dp, *tmp;
+    uint64_t oldest;
+
+    /* Someone else is already at it */
+    if (!spinlock_try(&deferred_lock)) {
+        return;
+    }
+
+    TAILQ_INIT(&ready);
+    oldest = rcu_oldest();
+    TAILQ_FOREACH_SAFE(dp, &deferred, link, tmp) {
+        if (dp->epoch > oldest)
+            continue;
+
+        TAILQ_REMOVE(&deferred, dp, link);
+        TAILQ_INSERT_TAIL(&ready, dp, link);
+    }
+
+    spinlock_release(&deferred_lock);
+
+    /* Callbacks may well retire more */
+    TAILQ_FOREACH_SAFE(dp, &ready, link, tmp) {
+        dp->fn(dp->arg);
+        os_pool_free(dp);
+    }
+}
+
+void
+ob_rcu_enter(void)
+{
+    struct rcu_cpu *cpu = rcu_self();
+
+    if (cpu->nest++ != 0) {
+        return;
+    }
+
+    /* Publish the epoch before reading anything */
+    cpu->epoch = rcu_epoch;
+    atomic_fence();
+}
+
+void
+ob_rcu_exit(void)
+{
+    struct rcu_cpu *cpu = rcu_self();
+
+    atomic_barrier();
+    if (--cpu->nest == 0) {
+        cpu->epoch = 0;
+    }
+}
+
+void
+ob_rcu_synchronize(void)
+{
+    struct rcu_cpu *cpu;
+    uint64_t target;
+
+    /* Sections entered from here on see the new epoch */
+    target = atomic_inc_64(&rcu_epoch);
+    for (size_t i = 0; i < CPU_MAX; ++i) {
+        cpu = &rcu_cpus[i];
+        while (cpu->epoch != 0 && cpu->epoch < target) {
+            mu_cpu_spinwait();
+        }
+    }
+
+    rcu_reclaim();
+}
+
+void
+ob_rcu_poll(void)
+{
+    rcu_reclaim();
+}
+
+void
+ob_rcu_call(void (*fn)(void *arg), void *arg)
+{
+    struct rcu_deferred *dp;
+
+    if (fn == NULL) {
+        return;
+    }
+
+    /* Fall back to waiting it out */
+    if ((dp = os_pool_allocate(sizeof(*dp))) == NULL) {
+        ob_rcu_synchronize();
+        fn(arg);
+        return;
+    }
+
+    /*
+     * Sections that observed an older epoch may still
+     * see the object, ones entered after this cannot.
+     */
+    dp->fn = fn;
+    dp->arg = arg;
+    dp->epoch = atomic_inc_64(&rcu_epoch);
+
+    spinlock_acquire(&deferred_lock, true);
+    TAILQ_INSERT_TAIL(&deferred, dp, link);
+    spinlock_release(&deferred_lock);
+    rcu_reclaim();
+}
+
+void
+ob_rcu_defer(void *ptr)
+{
+    if (ptr != NULL) {
+        ob_rcu_call(os_pool_free, ptr);
+    }
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2025 Ian Marco Moffett and the OpenModality engineers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/errno.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <ob/section.h>
+#include <os/pool.h>
+#include <mm/pmem.h>
+#include <mm/vmem.h>
+#include <mm/memvar.h>
+#include <lib/string.h>
+
+static int
+section_getpage(void *obj, size_t off, uintptr_t *res)
+{
+    struct ksection *sp = KNODE_SECTION((struct knode *)obj);
+    size_t idx;
+
+    idx = off / PAGESIZE;
+    if (idx >= sp->npages) {
+        return -EFAULT;
+    }
+
+    mm_pmem_ref(sp->frames[idx]);
+    *res = sp->frames[idx];
+    return 0;
+}
+
+static void
+section_ref(void *obj)
+{
+    ob_knode_ref(obj);
+}
+
+static void
+section_unref(void *obj)
+{
+    ob_knode_unref(obj);
+}
+
+static const struct vmem_pager section_pager = {
+    .getpage = section_getpage,
+    .ref = section_ref,
+    .unref = section_unref
+};
+
+int
+ob_section_new(const char *name, size_t length, struct knode **res)
+{
+    struct ksection *sp;
+    struct knode *knp;
+    uintptr_t pa;
+    int error;
+
+    if (name == NULL || res == NULL || length == 0) {
+        return -EINVAL;
+    }
+
+    error = ob_knode_new(name, K_SECTION, &knp);
+    if (error != 0) {
+        return error;
+    }
+
+    /* Allocate the data portion */
+    if ((sp = os_pool_allocate(sizeof(*sp))) == NULL) {
+        os_pool_free(knp);
+        return -ENOMEM;
+    }
+
+    sp->length = ALIGN_UP(length, PAGESIZE);
+    sp->npages = sp->length / PAGESIZE;
+    sp->frames = os_pool_allocate(sp->npages * sizeof(*sp->frames));
+    if (sp->frames == NULL) {
+        os_pool_free(sp);
+        os_pool_free(knp);
+        return -ENOMEM;
+    }
+
+    memset(sp->frames, 0, sp->npages * sizeof(*sp->frames));
+    knp->data = sp;
+
+    /*
+     * Frames need not be contiguous, taking them one at a
+     * time lets large sections come out of a fragmented
+     * physical memory map.
+     */
+    for (size_t i = 0; i < sp->npages; ++i) {
+        if ((pa = mm_pmem_alloc(1)) == 0) {
+            ob_section_destroy(knp);
+            os_pool_free(knp);
+            return -ENOMEM;
+        }
+
+        memset(PHYS_TO_VIRT(pa), 0, PAGESIZE);
+        sp->frames[i] = pa;
+    }
+
+    *res = knp;
+    return 0;
+}
+
+int
+ob_section_map(struct knode *knp, struct mu_vas *vas, uintptr_t addr,
+    size_t off, size_t length, int prot, int flags, uintptr_t *res)
+{
+    struct ksection *sp;
+
+    if (knp == NULL || knp->type != K_SECTION) {
+        return -EINVAL;
+    }
+
+    if ((sp = KNODE_SECTION(knp)) == NULL) {
+        return -EIO;
+    }
+
+    /* The mapping must lie within the section */
+    if (length == 0 || off >= sp->length || length > sp->length - off) {
+        return -EINVAL;
+    }
+
+    flags &= ~(MAP_ANON | MAP_HUGE);
+    return vmem_mmap_object(
+        vas, addr, length, prot, flags,
+        &section_pager, knp, off, res
+    );
+}
+
+void
+ob_section_release(struct knode *knp)
+{
+    if (knp == NULL || knp->type != K_SECTION) {
+        return;
+    }
+
+    ob_knode_unref(knp);
+}
+
+void
+ob_section_destroy(struct knode *knp)
+{
+    struct ksection *sp = KNODE_SECTION(knp);
+
+    if (sp == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < sp->npages; ++i) {
+        if (sp->frames[i] != 0)
+            mm_pmem_unref(sp->frames[i]);
+    }
+
+    os_pool_free(sp->frames);
+    os_pool_free(sp);
+}
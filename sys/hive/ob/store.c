@@ -35,6 +35,8 @@
 #include <lib/string.h>
 #include <ob/knode.h>
 #include <ob/dir.h>
+#include <ob/rcu.h>
+#include <ob/section.h>
 
 static bool is_init = false;
 static struct knode *root_dir;
@@ -42,39 +44,17 @@ static struct knode *root_dir;
 int
 ob_root_get(const char *name, struct knode **res)
 {
-    struct knode_dir *dir;
-    struct knode *knp, *knp_res;
-
     if (name == NULL || res == NULL) {
         return -EINVAL;
     }
 
-    dir = KNODE_DIR(root_dir);
-    knp_res = NULL;
-
     /* Is this root? */
     if (strcmp(name, "/") == 0) {
         *res = root_dir;
         return 0;
     }
 
-    TAILQ_FOREACH(knp, &dir->list, dir_link) {
-        if (LIKELY(knp->name[0] != *name)) {
-            continue;
-        }
-
-        if (strcmp(knp->name, name) == 0) {
-            knp_res = knp;
-            break;
-        }
-    }
-
-    if (knp_res == NULL) {
-        return -ENOENT;
-    }
-
-    *res = knp_res;
-    return 0;
+    return ob_dir_lookup(root_dir, name, res);
 }
 
 int
@@ -88,7 +68,9 @@ ob_root_foreach(ktype_t type, int(*cb)(struct knode *kn))
         return -1;
     }
 
+    /* Entries removed meanwhile are not freed under us */
     dir = KNODE_DIR(root_dir);
+    ob_rcu_enter();
     TAILQ_FOREACH(knp, &dir->list, dir_link) {
         if (knp->type != type) {
             continue;
@@ -98,6 +80,7 @@ ob_root_foreach(ktype_t type, int(*cb)(struct knode *kn))
             break;
         }
     }
+    ob_rcu_exit();
 
     return retval;
 }
@@ -110,7 +93,12 @@ ob_store_init(void)
     }
 
     is_init = true;
+    ob_knode_set_dtor(K_DIR, ob_dir_destroy);
+    ob_knode_set_dtor(K_SECTION, ob_section_destroy);
     if (ob_dir_new("/", &root_dir) != 0) {
         panic("ob: could not allocate root directory\n");
     }
+
+    /* Referenced from all over, never removed */
+    ob_knode_bias(root_dir);
 }